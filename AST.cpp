@@ -1,6 +1,7 @@
 #include "AST.h"
 
 #include <map>
+#include <ranges>
 
 #include "ProgramBuilder.h"
 
@@ -30,24 +31,37 @@ Symbol & ASTInteger::create_symbols(ProgramBuilder &builder, Context &parent) co
 ASTLetExpression::ASTLetExpression(
     std::string variable,
     std::unique_ptr<ASTExpression> assign,
-    std::unique_ptr<ASTExpression> then_do
+    std::unique_ptr<ASTExpression> then_do,
+    const bool recursive
 )
     : assign(std::move(assign))
     , then_do(std::move(then_do))
     , variable(std::move(variable))
+    , recursive(recursive)
 {}
 
 Symbol & ASTLetExpression::create_symbols(ProgramBuilder &builder, Context &parent) const {
     Context context(parent);
     auto &assign_symbol = assign->create_symbols(builder, parent);
+    if (recursive) {
+        const auto function = dynamic_cast<InlineFunction *>(&assign_symbol);
+        if (function == nullptr)
+            throw ProjectError("Only functions can be recursive: " + variable);
+        function->context.new_symbol(variable, *function);
+        function->recursive = true;
+    }
     context.new_symbol(variable, assign_symbol);
     auto &result_symbol = then_do->create_symbols(builder, context);
     return builder.new_symbol<ScopeSymbol>(assign_symbol, result_symbol);
 }
 
 Symbol & ASTBranch::create_symbols(ProgramBuilder &builder, Context &parent) const {
+    auto &condition_symbol = condition->create_symbols(builder, parent);
+    // A known condition selects its branch while compiling, no jump is left for it.
+    if (const auto literal = dynamic_cast<Literal *>(&condition_symbol))
+        return ((*literal)->jumps_on_jump_if_positive() ? then_do : else_do)->create_symbols(builder, parent);
     return builder.new_symbol<ConditionalResult>(
-        condition->create_symbols(builder, parent),
+        condition_symbol,
         then_do->create_symbols(builder, parent),
         else_do->create_symbols(builder, parent)
     );
@@ -85,15 +99,35 @@ void ASTMap::print(std::ostream &stream) const {
     stream << '}';
 }
 
+void ASTMap::read_names(std::unordered_set<std::string> &names) const {
+    for (const auto &value : map | std::views::values)
+        value->read_names(names);
+}
+
 Symbol & ASTMap::create_symbols(ProgramBuilder &builder, Context &parent) const {
-    Symbol *result = &builder.new_literal(Literal::map({}));
-    for (const auto &[index, value] : map)
-        result = &result->set(
-            Variant::integer(std::stoll(index)),
-            value->create_symbols(builder, parent),
-            builder
-        );
-    return *result;
+    return create_update(builder, parent, builder.new_literal(Literal::map({})));
+}
+
+Symbol & ASTMap::create_update(ProgramBuilder &builder, Context &parent, Symbol &original) const {
+    // Known values are set on a copy of a known map while compiling, so the whole literal is one
+    // constant and only the other entries are SET at run time.
+    std::optional<Variant> folded;
+    if (const auto literal = dynamic_cast<Literal *>(&original); literal != nullptr && (*literal)->type() == Variant::Type::MAP)
+        folded = **literal;
+    std::vector<std::pair<Variant, Symbol*>> unknown;
+    for (const auto &[index, value] : map) {
+        auto key = Variant::integer(std::stoll(index));
+        auto &symbol = value->create_symbols(builder, parent);
+        if (const auto literal = dynamic_cast<Literal *>(&symbol); literal != nullptr && folded.has_value())
+            static_cast<void>(folded->set(key, **literal));
+        else
+            unknown.emplace_back(std::move(key), &symbol);
+    }
+    Symbol &base = folded.has_value() ? builder.new_literal(Literal(std::move(*folded))) : original;
+    if (unknown.empty())
+        return base;
+    // A new symbol, updating the original one in place would change every other use of it.
+    return builder.new_symbol<UpdateSymbol>(base, std::move(unknown));
 }
 
 std::unique_ptr<ASTExpression> ASTMap::copy() const {
@@ -149,15 +183,7 @@ Symbol & ASTGetIndex::create_symbols(ProgramBuilder &builder, Context &parent) c
 }
 
 Symbol & ASTUpdateWith::create_symbols(ProgramBuilder &builder, Context &parent) const {
-    Symbol *result = &original_value->create_symbols(builder, parent);
-    for (auto &[index, value] : update_with->map ) {
-        result = &result->set(
-            Variant::integer(std::stoll(index)),
-            value->create_symbols(builder, parent),
-            builder
-        );
-    }
-    return *result;
+    return update_with->create_update(builder, parent, original_value->create_symbols(builder, parent));
 }
 
 Symbol & ASTCurry::create_symbols(ProgramBuilder &builder, Context &parent) const {
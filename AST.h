@@ -1,6 +1,8 @@
 #ifndef AST_H
 #define AST_H
 
+#include <unordered_set>
+
 #include "BytecodeBuilder.h"
 
 namespace project {
@@ -16,6 +18,8 @@ namespace project {
 
         virtual void print(std::ostream& stream) const = 0;
         virtual std::unique_ptr<ASTExpression> copy() const = 0;
+        /// Adds the names the expression evaluates, names bound inside of it included.
+        virtual void read_names(std::unordered_set<std::string>& names) const {}
     };
 
     struct ASTFloat final : ASTExpression {
@@ -45,6 +49,8 @@ namespace project {
         explicit ASTEvaluate(std::string name) : name(std::move(name)) {}
         Symbol & create_symbols(ProgramBuilder &builder, Context &parent) const override;
         void print(std::ostream& stream) const override { stream << name; }
+        void read_names(std::unordered_set<std::string>& names) const override
+        { names.insert(name); }
         std::unique_ptr<ASTExpression> copy() const override { return std::make_unique<ASTEvaluate>(name); }
     };
 
@@ -52,13 +58,18 @@ namespace project {
         std::unique_ptr<ASTExpression> assign;
         std::unique_ptr<ASTExpression> then_do;
         std::string variable;
-        ASTLetExpression(std::string variable, std::unique_ptr<ASTExpression> assign, std::unique_ptr<ASTExpression> then_do);
+        /// The assigned function sees itself under variable.
+        bool recursive;
+        ASTLetExpression(std::string variable, std::unique_ptr<ASTExpression> assign, std::unique_ptr<ASTExpression> then_do,
+            bool recursive = false);
         void print(std::ostream& stream) const override
-        { stream << "let " << variable << " = " <<  *assign << "\nin " << *then_do; }
+        { stream << (recursive ? "let rec " : "let ") << variable << " = " <<  *assign << "\nin " << *then_do; }
 
         Symbol & create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { assign->read_names(names); then_do->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
-        { return std::make_unique<ASTLetExpression>(variable, assign->copy(), then_do->copy()); }
+        { return std::make_unique<ASTLetExpression>(variable, assign->copy(), then_do->copy(), recursive); }
     };
 
     struct ASTBranch final : ASTExpression {
@@ -70,6 +81,8 @@ namespace project {
         void print(std::ostream& stream) const override
         { stream << *then_do << " if " << *condition << " else " << *else_do; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { condition->read_names(names); then_do->read_names(names); else_do->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTBranch>(condition->copy(), then_do->copy(), else_do->copy()); ;}
     };
@@ -81,6 +94,8 @@ namespace project {
             : body(std::move(body)), parameter_names(std::move(parameter_names)) {}
         void print(std::ostream& stream) const override;
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { body->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTFunction>(body->copy(), parameter_names); }
     };
@@ -92,8 +107,11 @@ namespace project {
             : map(std::move(map)) {}
         void print(std::ostream& stream) const override;
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        /// Symbol of original updated with the entries of this map.
+        Symbol& create_update(ProgramBuilder &builder, Context &parent, Symbol &original) const;
         void add(std::string name, std::unique_ptr<ASTExpression> expression)
         { map.emplace(std::move(name), std::move(expression)); }
+        void read_names(std::unordered_set<std::string>& names) const override;
         std::unique_ptr<ASTExpression> copy() const override;
     };
 
@@ -104,6 +122,8 @@ namespace project {
           : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " + " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTAddition>(first->copy(), second->copy()); }
     };
@@ -115,6 +135,8 @@ namespace project {
           : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " / " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTDivision>(first->copy(), second->copy()); }
     };
@@ -126,6 +148,8 @@ namespace project {
           : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " % " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTModulo>(first->copy(), second->copy()); }
 
@@ -138,6 +162,8 @@ namespace project {
           : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " * " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTMultiplication>(first->copy(), second->copy()); }
 
@@ -150,6 +176,8 @@ namespace project {
           : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " - " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTSubtraction>(first->copy(), second->copy()); }
 
@@ -160,6 +188,8 @@ namespace project {
         explicit ASTNegation(std::unique_ptr<ASTExpression> value) : value(std::move(value)) {}
         void print(std::ostream& stream) const override { stream << '-' << *value; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { value->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTNegation>(value->copy()); }
     };
@@ -171,6 +201,8 @@ namespace project {
            : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " = " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTEquality>(first->copy(), second->copy()); }
     };
@@ -182,6 +214,8 @@ namespace project {
             : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " & " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTConjunction>(first->copy(), second->copy()); }
 
@@ -194,6 +228,8 @@ namespace project {
             : first(std::move(first)), second(std::move(second)) {}
         void print(std::ostream& stream) const override { stream << *first << " | " << *second; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { first->read_names(names); second->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTDisjunction>(first->copy(), second->copy()); }
 
@@ -206,6 +242,8 @@ namespace project {
             : value(std::move(value)), index(std::move(index)) {}
         void print(std::ostream& stream) const override { stream << *value << "." << index; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { value->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
         { return std::make_unique<ASTGetIndex>(value->copy(), index); }
 
@@ -218,8 +256,10 @@ namespace project {
             : original_value(std::move(original_value)), update_with(std::move(update_with)) {}
         void print(std::ostream& stream) const override { stream << *original_value << " with " << *update_with; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { original_value->read_names(names); update_with->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
-        { return std::make_unique<ASTAddition>(original_value->copy(), update_with->copy()); }
+        { return std::make_unique<ASTUpdateWith>(original_value->copy(), std::unique_ptr<ASTMap>(static_cast<ASTMap *>(update_with->copy().release()))); }
 
     };
 
@@ -230,8 +270,10 @@ namespace project {
             : callable(std::move(callable)), value(std::move(value)) {}
         void print(std::ostream& stream) const override { stream << *callable << " " << *value; }
         Symbol& create_symbols(ProgramBuilder &builder, Context &parent) const override;
+        void read_names(std::unordered_set<std::string>& names) const override
+        { callable->read_names(names); value->read_names(names); }
         std::unique_ptr<ASTExpression> copy() const override
-        { return std::make_unique<ASTAddition>(callable->copy(), value->copy()); }
+        { return std::make_unique<ASTCurry>(callable->copy(), value->copy()); }
 
 
     };
@@ -0,0 +1,149 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+#include "BytecodeBuilder.h"
+#include "NativeCode.h"
+
+using namespace project;
+
+static Program arithmetic_loop(const size_t iterations) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(iterations);
+    const auto accumulator = builder.push(0);
+    const auto loop = builder.next_instruction_address();
+    builder.add(accumulator, counter);
+    builder.push(3);
+    builder.command(Program::OVERFLOW_MUL);
+    builder.push(1000003);
+    builder.command(Program::OVERFLOW_MOD);
+    builder.assign_from_top(accumulator);
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    return builder.build();
+}
+
+static Program map_building(const size_t entries) {
+    BytecodeBuilder builder;
+
+    builder.push(Variant::empty_map());
+    for (size_t i = 0; i < entries; ++i)
+        builder.stack_top_set(i, i * 2);
+    return builder.build();
+}
+
+static Program map_layering(const size_t entries, const size_t layers) {
+    BytecodeBuilder builder;
+
+    auto map = Variant::empty_map();
+    for (size_t i = 0; i < entries; ++i)
+        static_cast<void>(map.set(Variant::integer(i), Variant::integer(i)));
+    const auto base = builder.push(map);
+    for (size_t i = 0; i < layers; ++i) {
+        builder.push(base);
+        builder.stack_top_set(i, i + 1);
+        builder.pop();
+    }
+    return builder.build();
+}
+
+static Program sparse_lookup(const size_t iterations) {
+    BytecodeBuilder builder;
+
+    auto map = Variant::empty_map();
+    for (size_t i = 1; i <= 1000; ++i)
+        static_cast<void>(map.set(Variant::integer(i * 7919), Variant::integer(i)));
+    const auto counter = builder.push(iterations);
+    const auto table = builder.push(map);
+    const auto loop = builder.next_instruction_address();
+    for (size_t i = 1; i <= 8; ++i) {
+        builder.get(table, i * 97 * 7919);
+        builder.pop();
+    }
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    return builder.build();
+}
+
+static Program map_churn(const size_t iterations) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(iterations);
+    const auto loop = builder.next_instruction_address();
+    builder.push(Variant::empty_map());
+    for (size_t i = 0; i < 40; ++i)
+        builder.stack_top_set(i * 31, i);
+    builder.pop();
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    return builder.build();
+}
+
+static Program stack_shuffling(const size_t iterations) {
+    BytecodeBuilder builder;
+
+    auto map = Variant::empty_map();
+    for (size_t i = 0; i < 8; ++i)
+        static_cast<void>(map.set(Variant::integer(i), Variant::floating_point(i * 0.5)));
+    const auto counter = builder.push(iterations);
+    const auto table = builder.push(map);
+    const auto number = builder.push(1.5);
+    const auto loop = builder.next_instruction_address();
+    builder.push(table);
+    builder.push(number);
+    builder.push(counter);
+    builder.swap_top_with(2);
+    builder.swap_top_with(1);
+    builder.pop(3);
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    return builder.build();
+}
+
+static double measure(const Program &program, const size_t repetitions) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repetitions; ++i) {
+        auto result = program.execute();
+        if (result.empty())
+            std::cerr << "empty result\n";
+    }
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / static_cast<double>(repetitions);
+}
+
+static void compare_dispatch(const std::string &name, const Program &program, const size_t repetitions) {
+    const Program switched(program.instructions, program.constants, Program::Dispatch::SWITCH);
+    const double switch_time = measure(switched, repetitions);
+    std::cout << std::left << std::setw(24) << name
+        << "switch " << std::setw(10) << switch_time << " ms";
+    if (PROJECT_COMPUTED_GOTO) {
+        const Program threaded(program.instructions, program.constants, Program::Dispatch::THREADED);
+        const double threaded_time = measure(threaded, repetitions);
+        Program verified(program.instructions, program.constants, Program::Dispatch::THREADED);
+        verified.verify();
+        const double verified_time = measure(verified, repetitions);
+        std::cout << "  threaded " << std::setw(10) << threaded_time << " ms"
+            << "  verified " << std::setw(10) << verified_time << " ms"
+            << "  speedup " << switch_time / verified_time << 'x';
+    }
+    Program native(program.instructions, program.constants);
+    if (native.compile_native())
+        std::cout << "  native " << std::setw(10) << measure(native, repetitions) << " ms";
+    std::cout << '\n';
+}
+
+int main() {
+    compare_dispatch("arithmetic loop", arithmetic_loop(200000), 5);
+    compare_dispatch("map building", map_building(2000), 5);
+    compare_dispatch("map layering", map_layering(5000, 1000), 5);
+    compare_dispatch("map churn", map_churn(20000), 5);
+    compare_dispatch("sparse lookup", sparse_lookup(100000), 5);
+    compare_dispatch("stack shuffling", stack_shuffling(200000), 5);
+    std::cout << "sizeof(Variant) " << sizeof(Variant) << '\n';
+    return 0;
+}
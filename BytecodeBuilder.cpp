@@ -4,6 +4,7 @@
 
 #include "BytecodeBuilder.h"
 
+#include <algorithm>
 #include <stdexcept>
 
 using namespace project;
@@ -26,6 +27,13 @@ InstructionAddress::InstructionAddress(const Program::word offset)
         throw std::invalid_argument("offset is greater than Program::max_instructions_size");
 }
 
+FunctionAddress::FunctionAddress(const Program::word offset)
+    : offset(offset)
+{
+    if (offset > Program::max_call_target)
+        throw std::invalid_argument("offset is greater than Program::max_call_target");
+}
+
 void StackFrame::end_frame() {
     if (is_virtual)
         return;
@@ -36,6 +44,11 @@ void StackFrame::end_frame() {
     is_virtual = true;
 }
 
+void StackFrame::end_frame_below_top() {
+    assert(is_virtual == false);
+    builder.pop_below_top(old_stack_pointer);
+    is_virtual = true;
+}
 
 ConstantAddress BytecodeBuilder::next_constant_address() const {
     return ConstantAddress(static_cast<Program::word>(constants.size()));
@@ -54,8 +67,282 @@ InstructionAddress BytecodeBuilder::last_instruction_address() const {
 }
 
 ConstantAddress BytecodeBuilder::new_constant(const Variant &variant) {
+    requested_constants++;
+    const auto hash = variant.hash();
+    const auto [first, last] = constant_indices.equal_range(hash);
+    for (auto candidate = first; candidate != last; ++candidate) {
+        if (constants[candidate->second].is_identical(variant))
+            return ConstantAddress(candidate->second);
+    }
+    const auto address = next_constant_address();
     constants.push_back(variant);
-    return last_constant_address();
+    constant_indices.emplace(hash, address.offset);
+    return address;
+}
+
+/// Rewrites redundant instruction sequences of a whole program until none is left, and drops
+/// the instructions no path from the start or a function reaches. Jumps and local calls are
+/// retargeted. A rewritten sequence never continues past a jump or call target.
+static void optimize_peephole(std::vector<Program::Instruction> &code) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        const size_t size = code.size();
+        std::vector<bool> targets(size + 1);
+        for (const auto &[type, argument] : code) {
+            if (type == Program::JUMP_IF_POSITIVE)
+                targets[argument] = true;
+            else if (type == Program::CALL_LOCAL || type == Program::TAIL_CALL_LOCAL)
+                targets[Program::call_target(argument)] = true;
+        }
+        // The same pattern Program::verify() treats as an unconditional jump.
+        const auto unconditional = [&](const size_t index) {
+            return index + 1 < size && code[index].type == Program::PUSH_IMMEDIATE && code[index].argument > 0
+                && code[index + 1].type == Program::JUMP_IF_POSITIVE && targets[index + 1] == false;
+        };
+
+        // Jumps to an unconditional jump go to its target right away, unless it loops.
+        for (auto &[type, argument] : code) {
+            if (type != Program::JUMP_IF_POSITIVE)
+                continue;
+            std::vector<Program::word> visited;
+            auto target = argument;
+            while (unconditional(target) && std::ranges::find(visited, target) == visited.end()) {
+                visited.push_back(target);
+                target = code[target + 1].argument;
+            }
+            if (target != argument && unconditional(target) == false) {
+                argument = target;
+                changed = true;
+            }
+        }
+
+        std::vector<bool> removed(size);
+        const auto remove = [&](const size_t index) {
+            removed[index] = true;
+            changed = true;
+        };
+        const auto is_push = [](const Program::Instruction &instruction) {
+            return instruction.type == Program::PUSH_CONST || instruction.type == Program::PUSH_STACK
+                || instruction.type == Program::PUSH_IMMEDIATE;
+        };
+        for (size_t index = 0; index < size; ++index) {
+            auto &first = code[index];
+            if ((first.type == Program::SWAP || first.type == Program::POP) && first.argument == 0) {
+                remove(index);
+                continue;
+            }
+            if (unconditional(index)) {
+                // A jump to the next instruction.
+                if (code[index + 1].argument == index + 2) {
+                    remove(index);
+                    remove(index + 1);
+                }
+                ++index;
+                continue;
+            }
+            if (index + 1 == size || targets[index + 1])
+                continue;
+            auto &second = code[index + 1];
+            // A value pushed and popped right away.
+            if (is_push(first) && second.type == Program::POP && second.argument > 0) {
+                remove(index);
+                --second.argument;
+            }
+            else if (first.type == Program::POP && second.type == Program::POP
+                && first.argument + second.argument <= Program::max_word_limit) {
+                first.argument += second.argument;
+                remove(++index);
+            }
+            else if (first.type == Program::SWAP && second.type == Program::SWAP && first.argument == second.argument) {
+                remove(index);
+                remove(++index);
+            }
+            // SWAP k; POP k drops the k values below the top, two such drops are one.
+            else if (index + 3 < size && first.type == Program::SWAP && second.type == Program::POP
+                && first.argument == second.argument && targets[index + 2] == false && targets[index + 3] == false
+                && code[index + 2].type == Program::SWAP && code[index + 3].type == Program::POP
+                && code[index + 2].argument == code[index + 3].argument
+                && first.argument + code[index + 2].argument <= Program::max_word_limit) {
+                first.argument += code[index + 2].argument;
+                second.argument = first.argument;
+                remove(index + 2);
+                remove(index + 3);
+                index += 3;
+            }
+        }
+
+        // Follows the paths Program::verify() does.
+        std::vector<bool> reachable(size + 1);
+        std::vector<size_t> pending = {0};
+        for (size_t index = 0; index < size; ++index)
+            if (code[index].type == Program::CALL_LOCAL || code[index].type == Program::TAIL_CALL_LOCAL)
+                pending.push_back(Program::call_target(code[index].argument));
+        while (pending.empty() == false) {
+            const size_t index = pending.back();
+            pending.pop_back();
+            if (reachable[index])
+                continue;
+            reachable[index] = true;
+            if (index == size)
+                continue;
+            const auto [type, argument] = code[index];
+            if (type == Program::RETURN || type == Program::TAIL_CALL_LOCAL)
+                continue;
+            if (type == Program::JUMP_IF_POSITIVE) {
+                pending.push_back(argument);
+                if (index > 0 && unconditional(index - 1))
+                    continue;
+            }
+            pending.push_back(index + 1);
+        }
+        for (size_t index = 0; index < size; ++index)
+            if (reachable[index] == false && removed[index] == false)
+                remove(index);
+        if (changed == false)
+            break;
+
+        std::vector<Program::word> positions(size + 1);
+        size_t kept = 0;
+        for (size_t index = 0; index <= size; ++index) {
+            positions[index] = static_cast<Program::word>(kept);
+            if (index < size && removed[index] == false)
+                code[kept++] = code[index];
+        }
+        code.resize(kept);
+        for (auto &[type, argument] : code) {
+            if (type == Program::JUMP_IF_POSITIVE)
+                argument = positions[argument];
+            else if (type == Program::CALL_LOCAL || type == Program::TAIL_CALL_LOCAL)
+                argument = Program::local_call(positions[Program::call_target(argument)], Program::call_arguments(argument));
+        }
+    }
+}
+
+Program BytecodeBuilder::build() {
+    constant_indices.clear();
+    if (functions.empty() == false) {
+        // The program jumps over the functions placed after it, every call is relocated.
+        const auto end = unconditional_jump();
+        const auto offset = static_cast<Program::word>(instructions.size());
+        const auto relocate = [&](Program::Instruction &instruction, const bool in_function) {
+            if (instruction.type == Program::CALL_LOCAL || instruction.type == Program::TAIL_CALL_LOCAL) {
+                const FunctionAddress target(function_offsets.at(Program::call_target(instruction.argument)) + offset);
+                instruction.argument = Program::local_call(target.offset, Program::call_arguments(instruction.argument));
+            }
+            else if (instruction.type == Program::JUMP_IF_POSITIVE && in_function)
+                instruction.argument += offset;
+        };
+        for (auto &instruction : instructions)
+            relocate(instruction, false);
+        for (auto &instruction : functions)
+            relocate(instruction, true);
+        instructions.insert(instructions.end(), functions.begin(), functions.end());
+        functions.clear();
+        function_offsets.clear();
+        update_jump_location(end, next_instruction_address());
+    }
+    peephole.emitted = instructions.size();
+    optimize_peephole(instructions);
+    peephole.built = instructions.size();
+    Program program{std::move(instructions), std::move(constants)};
+    instructions.clear();
+    constants.clear();
+    requested_constants = 0;
+    return program;
+}
+
+EnclosingCode BytecodeBuilder::begin_function(const size_t frame_size) {
+    const FunctionAddress function(static_cast<Program::word>(function_offsets.size()));
+    function_offsets.push_back(0);
+    EnclosingCode enclosing{std::move(instructions), stack_pointer, functions.size(), function};
+    instructions.clear();
+    stack_pointer = frame_size;
+    return enclosing;
+}
+
+/// Removes the instructions of a function body that no path from its start reaches, like the
+/// code following a tail call. Jumps are relative to the start of the body.
+static void remove_unreachable(std::vector<Program::Instruction> &body) {
+    const size_t size = body.size();
+    std::vector<bool> jump_targets(size + 1);
+    for (const auto &[type, argument] : body)
+        if (type == Program::JUMP_IF_POSITIVE)
+            jump_targets[argument] = true;
+    // Follows the paths Program::verify() does.
+    std::vector<bool> reachable(size + 1);
+    std::vector<size_t> pending = {0};
+    while (pending.empty() == false) {
+        const size_t index = pending.back();
+        pending.pop_back();
+        if (reachable[index])
+            continue;
+        reachable[index] = true;
+        if (index == size)
+            continue;
+        const auto [type, argument] = body[index];
+        if (type == Program::RETURN || type == Program::TAIL_CALL_LOCAL)
+            continue;
+        if (type == Program::JUMP_IF_POSITIVE) {
+            pending.push_back(argument);
+            if (index > 0 && jump_targets[index] == false && body[index - 1].type == Program::PUSH_IMMEDIATE
+                && body[index - 1].argument > 0)
+                continue;
+        }
+        pending.push_back(index + 1);
+    }
+    std::vector<Program::word> positions(size + 1);
+    size_t kept = 0;
+    for (size_t index = 0; index <= size; ++index) {
+        positions[index] = static_cast<Program::word>(kept);
+        if (index < size && reachable[index])
+            body[kept++] = body[index];
+    }
+    body.resize(kept);
+    for (auto &[type, argument] : body)
+        if (type == Program::JUMP_IF_POSITIVE)
+            argument = positions[argument];
+}
+
+FunctionAddress BytecodeBuilder::end_function(EnclosingCode enclosing) {
+    assert(stack_pointer > 0);
+    command({Program::RETURN, static_cast<Program::word>(stack_pointer - 1)});
+    remove_unreachable(instructions);
+    const auto offset = static_cast<Program::word>(functions.size());
+    for (auto &instruction : instructions)
+        if (instruction.type == Program::JUMP_IF_POSITIVE)
+            instruction.argument += offset;
+    function_offsets.at(enclosing.function.offset) = offset;
+    functions.insert(functions.end(), instructions.begin(), instructions.end());
+    instructions = std::move(enclosing.instructions);
+    stack_pointer = enclosing.stack_pointer;
+    return enclosing.function;
+}
+
+void BytecodeBuilder::discard_function(EnclosingCode enclosing) {
+    functions.resize(enclosing.functions_size);
+    function_offsets.resize(enclosing.function.offset);
+    instructions = std::move(enclosing.instructions);
+    stack_pointer = enclosing.stack_pointer;
+}
+
+StackAddress BytecodeBuilder::call_local(const FunctionAddress function, const size_t arguments) {
+    assert(arguments <= Program::max_call_arguments);
+    command({Program::CALL_LOCAL, Program::local_call(function.offset, static_cast<Program::word>(arguments))});
+    return stack_top();
+}
+
+StackAddress BytecodeBuilder::tail_call_local(const FunctionAddress function, const size_t arguments) {
+    assert(arguments <= Program::max_call_arguments);
+    assert(stack_pointer >= 2 * arguments);
+    const size_t result = stack_pointer - arguments;
+    // The arguments are moved to the bottom of the frame and everything above them is dropped.
+    for (size_t i = arguments; i > 0; --i)
+        assign_from_top(StackAddress(i - 1));
+    pop_until(arguments);
+    command({Program::TAIL_CALL_LOCAL, Program::local_call(function.offset, static_cast<Program::word>(arguments))});
+    // Code following the call is unreachable, it sees the stack of a finished call.
+    stack_pointer = result + 1;
+    return stack_top();
 }
 
 StackAddress BytecodeBuilder::stack_top() const {
@@ -130,6 +417,15 @@ void BytecodeBuilder::pop_until(const size_t old_stack_pointer) {
     pop(stack_pointer - old_stack_pointer);
 }
 
+void BytecodeBuilder::pop_below_top(const size_t old_stack_pointer) {
+    assert(old_stack_pointer < stack_pointer);
+    const size_t below = stack_pointer - 1 - old_stack_pointer;
+    if (below == 0)
+        return;
+    // SWAP k; POP k drops the k values below the top.
+    swap_top_with(StackAddress(old_stack_pointer));
+    pop(below);
+}
 
 void BytecodeBuilder::swap_top_with(const uint16_t index) {
     command({Program::SWAP, index});
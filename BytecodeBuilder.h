@@ -1,5 +1,7 @@
 #pragma once
 
+#include <unordered_map>
+
 #include "Program.h"
 
 namespace project {
@@ -29,6 +31,16 @@ namespace project {
         friend std::ostream& operator<<(std::ostream& os, const InstructionAddress& ref) { return os << ref.offset; }
     };
 
+    /// Function compiled by a BytecodeBuilder, placed after the program by build(). Its body
+    /// can call it before end_function() gives it its place.
+    struct FunctionAddress {
+        const Program::word offset;
+
+        explicit FunctionAddress(Program::word offset);
+        bool operator==(const FunctionAddress & function) const = default;
+        friend std::ostream& operator<<(std::ostream& os, const FunctionAddress& ref) { return os << ref.offset; }
+    };
+
     struct JumpAddress  {
         InstructionAddress address;
 
@@ -36,8 +48,39 @@ namespace project {
         explicit JumpAddress(const Program::word offset) : address(offset) {}
     };
 
+    /// How many constants a BytecodeBuilder was asked for and how many it stores.
+    struct ConstantPoolStatistics {
+        size_t requested = 0;
+        size_t stored = 0;
+        /// Requests answered with an already stored constant.
+        [[nodiscard]] size_t reused() const { return requested - stored; }
+        friend std::ostream& operator<<(std::ostream& os, const ConstantPoolStatistics& statistics) {
+            return os << statistics.stored << " constants stored for " << statistics.requested << " requested";
+        }
+    };
+
+    /// How many instructions BytecodeBuilder::build() got and how many are left after it
+    /// rewrote the redundant ones.
+    struct PeepholeStatistics {
+        size_t emitted = 0;
+        size_t built = 0;
+        [[nodiscard]] size_t removed() const { return emitted - built; }
+        friend std::ostream& operator<<(std::ostream& os, const PeepholeStatistics& statistics) {
+            return os << statistics.built << " instructions built of " << statistics.emitted << " emitted";
+        }
+    };
+
     struct BytecodeBuilder;
 
+    /// Code set aside while a function body is compiled, see BytecodeBuilder::begin_function().
+    struct EnclosingCode {
+        std::vector<Program::Instruction> instructions;
+        size_t stack_pointer;
+        size_t functions_size;
+        /// The function being compiled.
+        FunctionAddress function;
+    };
+
     struct StackFrame {
         BytecodeBuilder& builder;
         size_t old_stack_pointer;
@@ -58,6 +101,8 @@ namespace project {
         StackFrame& operator=(StackFrame&& other) = delete;
 
         void end_frame();
+        /// Ends the frame with the value on top in place of the first value of the frame.
+        void end_frame_below_top();
         [[nodiscard]] StackAddress frame_start() const { return StackAddress(old_stack_pointer); }
     };
 
@@ -68,7 +113,12 @@ namespace project {
         [[nodiscard]] ConstantAddress last_constant_address() const;
         [[nodiscard]] InstructionAddress next_instruction_address() const;
         [[nodiscard]] InstructionAddress last_instruction_address() const;
+        /// Address of a constant identical to variant, stored first if there is none yet.
         ConstantAddress new_constant(const Variant& variant);
+        /// Constants of the program being built, build() starts the counts again.
+        [[nodiscard]] ConstantPoolStatistics constant_pool_statistics() const { return {requested_constants, constants.size()}; }
+        /// Effect of the peephole pass of the last build().
+        [[nodiscard]] PeepholeStatistics peephole_statistics() const { return peephole; }
         [[nodiscard]] StackAddress stack_top() const;
         [[nodiscard]] size_t real_address(StackAddress ref) const;
 
@@ -102,6 +152,8 @@ namespace project {
 
         void pop(size_t amount = 1);
         void pop_until(size_t old_stack_pointer);
+        /// Pops the values from old_stack_pointer up to the top one, which takes their place.
+        void pop_below_top(size_t old_stack_pointer);
         void return_until(const size_t old_stack_pointer) { stack_pointer = old_stack_pointer; };
         [[nodiscard]] size_t current_stack_pointer() const { return stack_pointer; };
         void swap_top_with(uint16_t index = 1);
@@ -126,10 +178,27 @@ namespace project {
         template <typename REF, typename...TYPES>
         StackAddress call(REF&& callable, TYPES&&...arguments);
 
+        /// Sends the following instructions to the body of a new function whose frame starts
+        /// with frame_size values, jumps in it are relative to its start.
+        EnclosingCode begin_function(size_t frame_size);
+        /// Ends the body with RETURN of the value on top, drops its unreachable instructions
+        /// and continues the enclosing code.
+        FunctionAddress end_function(EnclosingCode enclosing);
+        /// Drops the body together with the functions compiled inside of it.
+        void discard_function(EnclosingCode enclosing);
+        /// Replaces the arguments topmost values by the result of function.
+        StackAddress call_local(FunctionAddress function, size_t arguments);
+        /// Replaces the frame of the function being compiled by the arguments topmost values and
+        /// continues in function, which returns in its place. The frame must hold at least
+        /// as many values below the arguments.
+        StackAddress tail_call_local(FunctionAddress function, size_t arguments);
+
         void command(const Instruction instruction) { command({instruction, 0}); }
         void command(Program::Instruction instruction);
 
-        Program build() { return {std::move(instructions), std::move(constants)}; }
+        /// Places the functions after the program and rewrites redundant instruction sequences,
+        /// see peephole_statistics().
+        Program build();
 
         [[nodiscard]] Program::Instruction instruction_at(const size_t index) const { return instructions.at(index); }
         [[nodiscard]] const Variant& constant_at(const size_t index) const { return constants.at(index); }
@@ -138,7 +207,16 @@ namespace project {
 
     private:
         std::vector<Program::Instruction> instructions;
+        /// Bodies of the finished functions.
+        std::vector<Program::Instruction> functions;
+        /// Start of every function in functions by FunctionAddress, CALL_LOCAL and TAIL_CALL_LOCAL
+        /// refer to these addresses until build().
+        std::vector<Program::word> function_offsets;
         std::vector<Variant> constants;
+        /// Indices of the constants by Variant::hash().
+        std::unordered_multimap<size_t, Program::word> constant_indices;
+        size_t requested_constants = 0;
+        PeepholeStatistics peephole;
         size_t stack_pointer = 0;
     };
 
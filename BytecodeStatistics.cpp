@@ -0,0 +1,59 @@
+#include "BytecodeStatistics.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+using namespace project;
+
+NgramCounter::NgramCounter(const size_t length)
+    : ngram_length(length)
+{
+    if (length == 0)
+        throw std::invalid_argument("NgramCounter length must be positive");
+}
+
+void NgramCounter::add(const Program &program) {
+    const auto &instructions = program.instructions;
+    std::vector<bool> jump_targets(instructions.size() + 1);
+    for (const auto &[type, argument] : instructions)
+        if (type == Program::JUMP_IF_POSITIVE && argument <= instructions.size())
+            jump_targets[argument] = true;
+    for (size_t start = 0; start + ngram_length <= instructions.size(); ++start) {
+        const auto end = start + ngram_length;
+        if (std::any_of(jump_targets.begin() + start + 1, jump_targets.begin() + end, [](bool target) { return target; }))
+            continue;
+        Ngram ngram;
+        ngram.reserve(ngram_length);
+        for (size_t i = start; i < end; ++i)
+            ngram.push_back(instructions[i].type);
+        counts[ngram]++;
+        counted++;
+    }
+}
+
+size_t NgramCounter::count(const Ngram &ngram) const {
+    const auto found = counts.find(ngram);
+    return found == counts.end() ? 0 : found->second;
+}
+
+std::vector<std::pair<NgramCounter::Ngram, size_t>> NgramCounter::most_frequent(const size_t limit) const {
+    std::vector<std::pair<Ngram, size_t>> result(counts.begin(), counts.end());
+    std::stable_sort(result.begin(), result.end(), [](const auto &first, const auto &second) {
+        return first.second > second.second;
+    });
+    if (result.size() > limit)
+        result.resize(limit);
+    return result;
+}
+
+void NgramCounter::report(std::ostream &stream, const size_t limit) const {
+    stream << ngram_length << "-grams (" << counted << " counted)\n";
+    for (const auto &[ngram, count] : most_frequent(limit)) {
+        stream << std::setw(10) << count << ' '
+            << std::fixed << std::setprecision(1) << std::setw(5) << 100.0 * count / counted << "% ";
+        for (const auto type : ngram)
+            stream << ' ' << Program::instruction_name(type);
+        stream << '\n';
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+
+#include "Program.h"
+
+namespace project {
+
+    /// Counts instruction type sequences of a fixed length over a corpus of programs,
+    /// used to choose the superinstructions fused by Program from data.
+    class NgramCounter {
+    public:
+        using Ngram = std::vector<Program::InstructionType>;
+
+        explicit NgramCounter(size_t length);
+
+        /// Counts every window of the program, except those with a jump target inside,
+        /// since they could not be fused.
+        void add(const Program& program);
+
+        [[nodiscard]] size_t length() const { return ngram_length; }
+        [[nodiscard]] size_t total() const { return counted; }
+        [[nodiscard]] size_t count(const Ngram& ngram) const;
+        /// At most limit n-grams, the most frequent first.
+        [[nodiscard]] std::vector<std::pair<Ngram, size_t>> most_frequent(size_t limit) const;
+        void report(std::ostream& stream, size_t limit) const;
+
+    private:
+        size_t ngram_length;
+        std::map<Ngram, size_t> counts;
+        size_t counted = 0;
+    };
+
+}
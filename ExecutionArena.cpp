@@ -0,0 +1,122 @@
+#include "ExecutionArena.h"
+
+#include <algorithm>
+#include <bit>
+#include <new>
+
+#include "core.h"
+
+using namespace project;
+
+namespace {
+    /// Every allocation is preceded by the arena it came from, nullptr for the global heap.
+    constexpr size_t header_size = 16;
+    constexpr size_t smallest_class_bits = 5;
+    constexpr size_t max_block_size = 1024 * 1024;
+
+    thread_local ExecutionArena* active = nullptr;
+
+    size_t class_size(const size_t size_class) { return size_t{1} << (size_class + smallest_class_bits); }
+
+    size_t size_class_of(const size_t total) {
+        const auto bits = std::bit_width(std::max(total, class_size(0)) - 1);
+        return bits - smallest_class_bits;
+    }
+}
+
+ExecutionArena::Scope::Scope() {
+    if (active == nullptr) {
+        arena = new ExecutionArena;
+        active = arena;
+    }
+}
+
+void ExecutionArena::Scope::end() {
+    if (arena == nullptr)
+        return;
+    active = nullptr;
+    if (arena->state.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete arena;
+    arena = nullptr;
+}
+
+void ExecutionArena::Scope::copy_out(std::vector<Variant> &values) {
+    if (arena == nullptr)
+        return;
+    // The copies have to land on the global heap.
+    active = nullptr;
+    for (auto &value : values)
+        value = copied_out(value, arena);
+    end();
+}
+
+ExecutionArena::~ExecutionArena() {
+    for (const auto block : blocks)
+        ::operator delete(block, std::align_val_t(alignment));
+}
+
+void * ExecutionArena::allocate(const size_t size) {
+    const auto total = size + header_size;
+    auto arena = active;
+    void* memory;
+    if (arena != nullptr && total <= class_size(class_count - 1))
+        memory = arena->take(size_class_of(total));
+    else {
+        memory = ::operator new(total, std::align_val_t(alignment));
+        arena = nullptr;
+    }
+    *static_cast<ExecutionArena**>(memory) = arena;
+    return static_cast<std::byte*>(memory) + header_size;
+}
+
+void ExecutionArena::deallocate(void *memory, const size_t size) noexcept {
+    const auto start = static_cast<std::byte*>(memory) - header_size;
+    if (const auto arena = owner(memory))
+        arena->give_back(start, size_class_of(size + header_size));
+    else
+        ::operator delete(start, std::align_val_t(alignment));
+}
+
+ExecutionArena * ExecutionArena::owner(const void *memory) {
+    return *reinterpret_cast<ExecutionArena* const*>(static_cast<const std::byte*>(memory) - header_size);
+}
+
+void * ExecutionArena::take(const size_t size_class) {
+    state.fetch_add(2, std::memory_order_relaxed);
+    if (const auto free = free_lists[size_class]) {
+        free_lists[size_class] = *static_cast<void**>(free);
+        return free;
+    }
+    const auto size = class_size(size_class);
+    if (static_cast<size_t>(limit - cursor) < size) {
+        const auto block_size = std::max(next_block_size, size);
+        cursor = static_cast<std::byte*>(::operator new(block_size, std::align_val_t(alignment)));
+        limit = cursor + block_size;
+        blocks.push_back(cursor);
+        next_block_size = std::min(next_block_size * 2, max_block_size);
+    }
+    const auto memory = cursor;
+    cursor += size;
+    return memory;
+}
+
+void ExecutionArena::give_back(void *memory, const size_t size_class) noexcept {
+    // Only the thread running the scope touches the free lists, releases from elsewhere
+    // leave the memory to be freed with the blocks.
+    if (active == this) {
+        *static_cast<void**>(memory) = free_lists[size_class];
+        free_lists[size_class] = memory;
+    }
+    if (state.fetch_sub(2, std::memory_order_acq_rel) == 2)
+        delete this;
+}
+
+Variant ExecutionArena::copied_out(const Variant &value, const ExecutionArena *arena) {
+    if (value.is_inlined() || owner(value.cell()) != arena)
+        return value;
+    if (value.type() == Variant::Type::FUNCTION)
+        return Variant(value.function_cell()->value, value.function_cell()->arity);
+    return Variant(value.map_cell()->value.transformed([arena](const Variant &item) {
+        return copied_out(item, arena);
+    }));
+}
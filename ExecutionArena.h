@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace project {
+    struct Variant;
+
+    /// Memory for the heap values created while a Program runs, see Scope. Small allocations are
+    /// bump allocated from blocks owned by the arena and recycled by size class on the running
+    /// thread. The blocks are freed together once the run has ended and the last allocation made
+    /// from them is released, so values that outlive the run stay valid on any thread.
+    class ExecutionArena {
+    public:
+        /// Makes a fresh arena the allocation target of this thread for the lifetime of the scope,
+        /// unless an outer scope already did.
+        class Scope {
+        public:
+            Scope();
+            ~Scope() { end(); }
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+            /// Ends the scope and replaces the maps and functions of values whose cell lives in its
+            /// arena by copies on the global heap, so the arena goes away with the run's temporaries.
+            void copy_out(std::vector<Variant>& values);
+
+        private:
+            ExecutionArena* arena = nullptr;
+
+            void end();
+        };
+
+        /// Allocates from the arena of the active scope, or from the global heap when there is none.
+        /// The memory is aligned for types of up to 16 bytes alignment.
+        static void* allocate(size_t size);
+        static void deallocate(void* memory, size_t size) noexcept;
+
+        ExecutionArena(const ExecutionArena&) = delete;
+        ExecutionArena& operator=(const ExecutionArena&) = delete;
+
+    private:
+        static constexpr size_t alignment = 16;
+        static constexpr size_t class_count = 8;
+
+        ExecutionArena() = default;
+        ~ExecutionArena();
+
+        /// Twice the allocations not yet released, plus one until the scope ends.
+        std::atomic<size_t> state = 1;
+        std::array<void*, class_count> free_lists{};
+        std::vector<void*> blocks;
+        std::byte* cursor = nullptr;
+        std::byte* limit = nullptr;
+        size_t next_block_size = 16 * 1024;
+
+        void* take(size_t size_class);
+        void give_back(void* memory, size_t size_class) noexcept;
+        [[nodiscard]] static ExecutionArena* owner(const void* memory);
+        [[nodiscard]] static Variant copied_out(const Variant& value, const ExecutionArena* arena);
+    };
+
+    /// Stateless allocator over ExecutionArena for the storage of Variant maps.
+    template<class T>
+    struct ArenaAllocator {
+        using value_type = T;
+
+        ArenaAllocator() = default;
+        template<class U>
+        explicit(false) ArenaAllocator(const ArenaAllocator<U>&) noexcept {}
+
+        T* allocate(const size_t count) {
+            static_assert(alignof(T) <= 16);
+            return static_cast<T*>(ExecutionArena::allocate(count * sizeof(T)));
+        }
+        void deallocate(T* memory, const size_t count) noexcept { ExecutionArena::deallocate(memory, count * sizeof(T)); }
+
+        template<class U>
+        bool operator==(const ArenaAllocator<U>&) const noexcept { return true; }
+    };
+
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PROJECT_SIMD_PROBING 1
+#else
+#define PROJECT_SIMD_PROBING 0
+#endif
+
+namespace project {
+
+    /// Open addressing hash table with integer keys, entries stored inline in one slot array.
+    /// A parallel array of control bytes holds 7 bits of each key's hash, or marks the slot empty
+    /// or deleted, and lookups compare a whole group of 16 control bytes at once before touching
+    /// any slot. Groups are probed quadratically, the table grows at 7/8 load.
+    template<std::integral KEY, class VALUE, class ALLOCATOR = std::allocator<VALUE>>
+    class FlatMap {
+    public:
+        struct Entry {
+            KEY key;
+            VALUE value;
+        };
+
+        class Iterator;
+
+        FlatMap() = default;
+        FlatMap(const FlatMap& other)
+            : FlatMap(other.transformed([](const VALUE &value) -> const VALUE& { return value; })) {}
+        FlatMap(FlatMap&& other) noexcept { swap(other); }
+        FlatMap& operator=(FlatMap other) noexcept {
+            swap(other);
+            return *this;
+        }
+        ~FlatMap();
+
+        [[nodiscard]] size_t size() const { return count; }
+        [[nodiscard]] bool empty() const { return count == 0; }
+
+        [[nodiscard]] const VALUE* find(KEY key) const;
+        [[nodiscard]] VALUE* find(const KEY key) {
+            return const_cast<VALUE*>(std::as_const(*this).find(key));
+        }
+
+        /// Returns true when the key was not present before.
+        bool insert_or_assign(KEY key, VALUE value);
+        /// Removes the key and returns its value.
+        std::optional<VALUE> extract(KEY key);
+
+        /// Copy with the same layout, every value replaced by functor(value).
+        template<class FUNCTOR>
+        [[nodiscard]] FlatMap transformed(FUNCTOR&& functor) const;
+
+        [[nodiscard]] Iterator begin() const { return Iterator(this, 0); }
+        [[nodiscard]] Iterator end() const { return Iterator(this, capacity); }
+
+        void swap(FlatMap& other) noexcept {
+            std::swap(controls, other.controls);
+            std::swap(slots, other.slots);
+            std::swap(capacity, other.capacity);
+            std::swap(count, other.count);
+            std::swap(growth_left, other.growth_left);
+        }
+
+    private:
+        static constexpr size_t group_width = 16;
+        static constexpr std::int8_t empty_control = -128;
+        static constexpr std::int8_t deleted_control = -2;
+
+        /// The 16 control bytes of one group, full slots hold a value in 0..127.
+        class Group {
+        public:
+            [[nodiscard]] std::uint32_t match_empty() const { return match(empty_control); }
+#if PROJECT_SIMD_PROBING
+            explicit Group(const std::int8_t* controls)
+                : controls(_mm_loadu_si128(reinterpret_cast<const __m128i*>(controls))) {}
+
+            [[nodiscard]] std::uint32_t match(const std::int8_t control) const {
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(control), controls));
+            }
+            [[nodiscard]] std::uint32_t match_free() const {
+                return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), controls));
+            }
+
+        private:
+            __m128i controls;
+#else
+            explicit Group(const std::int8_t* controls) : controls(controls) {}
+
+            [[nodiscard]] std::uint32_t match(const std::int8_t control) const {
+                std::uint32_t result = 0;
+                for (size_t i = 0; i < group_width; ++i)
+                    result |= static_cast<std::uint32_t>(controls[i] == control) << i;
+                return result;
+            }
+            [[nodiscard]] std::uint32_t match_free() const {
+                std::uint32_t result = 0;
+                for (size_t i = 0; i < group_width; ++i)
+                    result |= static_cast<std::uint32_t>(controls[i] < -1) << i;
+                return result;
+            }
+
+        private:
+            const std::int8_t* controls;
+#endif
+        };
+
+        using ControlAllocator = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<std::int8_t>;
+        using SlotAllocator = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<Entry>;
+
+        std::int8_t* controls = nullptr;
+        Entry* slots = nullptr;
+        size_t capacity = 0;
+        size_t count = 0;
+        /// Insertions into empty slots left before the table is rebuilt.
+        size_t growth_left = 0;
+
+        static std::uint64_t hash(const KEY key) {
+            // splitmix64 finalizer, spreads consecutive keys over all groups.
+            auto value = static_cast<std::uint64_t>(key);
+            value = (value ^ value >> 30) * 0xbf58476d1ce4e5b9ULL;
+            value = (value ^ value >> 27) * 0x94d049bb133111ebULL;
+            return value ^ value >> 31;
+        }
+
+        static std::int8_t control_of(const std::uint64_t hash) { return static_cast<std::int8_t>(hash & 0x7f); }
+        [[nodiscard]] size_t first_group(const std::uint64_t hash) const { return (hash >> 7) & (capacity / group_width - 1); }
+        [[nodiscard]] size_t next_group(const size_t group, const size_t step) const {
+            return (group + step) & (capacity / group_width - 1);
+        }
+
+        /// Sets up empty storage of new_capacity slots, all marked empty_control.
+        void allocate(size_t new_capacity);
+        [[nodiscard]] size_t find_index(KEY key) const;
+        [[nodiscard]] size_t free_index(std::uint64_t hash) const;
+        void rehash(size_t new_capacity);
+
+    public:
+        /// Visits the entries in slot order.
+        class Iterator {
+        public:
+            using value_type = Entry;
+            using difference_type = std::ptrdiff_t;
+            using reference = const Entry&;
+            using pointer = const Entry*;
+            using iterator_category = std::forward_iterator_tag;
+
+            Iterator() = default;
+            Iterator(const FlatMap* map, const size_t index) : map(map), index(index) { settle(); }
+
+            reference operator*() const { return map->slots[index]; }
+            pointer operator->() const { return &map->slots[index]; }
+            Iterator& operator++() {
+                index++;
+                settle();
+                return *this;
+            }
+            Iterator operator++(int) {
+                auto old = *this;
+                ++*this;
+                return old;
+            }
+            bool operator==(const Iterator& other) const { return index == other.index; }
+
+        private:
+            const FlatMap* map = nullptr;
+            size_t index = 0;
+
+            void settle() {
+                while (index < map->capacity && map->controls[index] < 0)
+                    index++;
+            }
+        };
+    };
+
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+template<class FUNCTOR>
+project::FlatMap<KEY, VALUE, ALLOCATOR> project::FlatMap<KEY, VALUE, ALLOCATOR>::transformed(FUNCTOR&& functor) const {
+    FlatMap result;
+    if (capacity == 0)
+        return result;
+    result.allocate(capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+        if (controls[i] < 0)
+            continue;
+        std::construct_at(result.slots + i, Entry{slots[i].key, functor(slots[i].value)});
+        result.controls[i] = controls[i];
+        result.count++;
+    }
+    std::copy_n(controls, capacity, result.controls);
+    result.growth_left = growth_left;
+    return result;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+void project::FlatMap<KEY, VALUE, ALLOCATOR>::allocate(const size_t new_capacity) {
+    controls = ControlAllocator().allocate(new_capacity);
+    std::fill_n(controls, new_capacity, empty_control);
+    slots = SlotAllocator().allocate(new_capacity);
+    capacity = new_capacity;
+    growth_left = new_capacity / 8 * 7;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+project::FlatMap<KEY, VALUE, ALLOCATOR>::~FlatMap() {
+    if (capacity == 0)
+        return;
+    for (size_t i = 0; i < capacity; ++i) {
+        if (controls[i] >= 0)
+            std::destroy_at(slots + i);
+    }
+    SlotAllocator().deallocate(slots, capacity);
+    ControlAllocator().deallocate(controls, capacity);
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+size_t project::FlatMap<KEY, VALUE, ALLOCATOR>::find_index(const KEY key) const {
+    if (count == 0)
+        return capacity;
+    const auto key_hash = hash(key);
+    const auto control = control_of(key_hash);
+    auto group = first_group(key_hash);
+    for (size_t step = 1;; ++step) {
+        const Group controls_of_group(controls + group * group_width);
+        for (auto matches = controls_of_group.match(control); matches != 0; matches &= matches - 1) {
+            const auto index = group * group_width + std::countr_zero(matches);
+            if (slots[index].key == key)
+                return index;
+        }
+        // Insertion fills the first free slot on the probe path, so a group with an empty
+        // slot ends the path.
+        if (controls_of_group.match_empty() != 0)
+            return capacity;
+        group = next_group(group, step);
+    }
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+size_t project::FlatMap<KEY, VALUE, ALLOCATOR>::free_index(const std::uint64_t hash) const {
+    auto group = first_group(hash);
+    for (size_t step = 1;; ++step) {
+        if (const auto free = Group(controls + group * group_width).match_free(); free != 0)
+            return group * group_width + std::countr_zero(free);
+        group = next_group(group, step);
+    }
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+const VALUE* project::FlatMap<KEY, VALUE, ALLOCATOR>::find(const KEY key) const {
+    const auto index = find_index(key);
+    return index == capacity ? nullptr : &slots[index].value;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+bool project::FlatMap<KEY, VALUE, ALLOCATOR>::insert_or_assign(const KEY key, VALUE value) {
+    if (const auto found = find(key)) {
+        *found = std::move(value);
+        return false;
+    }
+    if (growth_left == 0) {
+        // Deleted slots count against the growth, a table mostly made of them is only cleaned.
+        const auto max_load = capacity / 8 * 7;
+        rehash(capacity == 0 ? group_width : count < max_load / 2 ? capacity : capacity * 2);
+    }
+    const auto key_hash = hash(key);
+    const auto index = free_index(key_hash);
+    if (controls[index] == empty_control)
+        growth_left--;
+    controls[index] = control_of(key_hash);
+    std::construct_at(slots + index, Entry{key, std::move(value)});
+    count++;
+    return true;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+std::optional<VALUE> project::FlatMap<KEY, VALUE, ALLOCATOR>::extract(const KEY key) {
+    const auto index = find_index(key);
+    if (index == capacity)
+        return std::nullopt;
+    std::optional<VALUE> result(std::move(slots[index].value));
+    std::destroy_at(slots + index);
+    // No probe path continues past a group that already has an empty slot.
+    if (Group(controls + index / group_width * group_width).match_empty() != 0) {
+        controls[index] = empty_control;
+        growth_left++;
+    }
+    else
+        controls[index] = deleted_control;
+    count--;
+    return result;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+void project::FlatMap<KEY, VALUE, ALLOCATOR>::rehash(const size_t new_capacity) {
+    FlatMap rebuilt;
+    rebuilt.allocate(new_capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+        if (controls[i] < 0)
+            continue;
+        const auto key_hash = hash(slots[i].key);
+        const auto index = rebuilt.free_index(key_hash);
+        rebuilt.controls[index] = control_of(key_hash);
+        std::construct_at(rebuilt.slots + index, std::move(slots[i]));
+        rebuilt.growth_left--;
+        rebuilt.count++;
+    }
+    swap(rebuilt);
+}
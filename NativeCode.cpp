@@ -0,0 +1,628 @@
+#include "NativeCode.h"
+
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <map>
+
+#if PROJECT_NATIVE_CODE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace project;
+
+namespace {
+
+    /// State shared between the generated code and the runtime helpers it calls.
+    struct NativeFrame {
+        /// Top of the stack at the failing instruction, written by the generated code.
+        Variant* error_top = nullptr;
+        /// Frame of the function entered by the last CALL_LOCAL, written by enter_call().
+        Variant* base = nullptr;
+        /// Past the return address of the innermost CALL_LOCAL in returns.
+        std::uintptr_t* returns_top = nullptr;
+        std::vector<Variant>* stack;
+        const Program* program;
+        /// Slots the deepest instruction of any frame uses, kept available above each frame.
+        size_t frame_size;
+        std::vector<std::uintptr_t> returns;
+        std::exception_ptr error;
+    };
+
+    static_assert(offsetof(NativeFrame, error_top) == 0);
+
+    // Helpers called by the generated code. They receive the frame, a stack slot and the
+    // instruction argument, and return non-zero after storing the exception they caught.
+    using Helper = int (*)(NativeFrame*, Variant*, size_t);
+
+    template<class FUNCTOR>
+    int guarded(NativeFrame* frame, FUNCTOR functor) noexcept {
+        try {
+            functor();
+            return 0;
+        }
+        catch (...) {
+            frame->error = std::current_exception();
+            return 1;
+        }
+    }
+
+    int copy_slot(NativeFrame*, Variant* slot, const size_t index) {
+        *slot = slot[-1 - static_cast<std::ptrdiff_t>(index)];
+        return 0;
+    }
+
+    int copy_constant(NativeFrame* frame, Variant* slot, const size_t index) {
+        *slot = frame->program->constants[index];
+        return 0;
+    }
+
+    int release_slots(NativeFrame*, Variant* slot, const size_t amount) {
+        for (size_t i = 0; i < amount; ++i)
+            slot[i] = Variant();
+        return 0;
+    }
+
+    template<std::optional<Variant> (Variant::*OPERATION)(const Variant&) const>
+    int arithmetic(NativeFrame* frame, Variant* first, size_t) {
+        return guarded(frame, [&] {
+            first[0] = (first[0].*OPERATION)(first[1]).value();
+            first[1] = Variant();
+        });
+    }
+
+    template<Variant (Variant::*OPERATION)(const Variant&) const>
+    int logical(NativeFrame* frame, Variant* first, size_t) {
+        return guarded(frame, [&] {
+            first[0] = (first[0].*OPERATION)(first[1]);
+            first[1] = Variant();
+        });
+    }
+
+    int push_global(NativeFrame* frame, Variant* top, size_t) {
+        return guarded(frame, [&] {
+            const size_t index = top->try_to_index().value();
+            const size_t position = top - frame->stack->data();
+            if (index >= position)
+                throw std::out_of_range("Program::push_global: index out of range");
+            *top = (*frame->stack)[position - index - 1];
+        });
+    }
+
+    int call(NativeFrame* frame, Variant* arguments, const size_t argument_count) {
+        return guarded(frame, [&] {
+            Variant callable = arguments[argument_count];
+            auto result = callable.call({arguments, argument_count});
+            release_slots(frame, arguments, argument_count + 1);
+            arguments[0] = std::move(result);
+        });
+    }
+
+    /// Pushes the code address a RETURN continues at and makes room for the frame of the
+    /// callee, which starts at base. The stack may move, the callee reads its frame back.
+    int enter_call(NativeFrame* frame, Variant* base, const size_t return_address) {
+        return guarded(frame, [&] {
+            auto &returns = frame->returns;
+            const size_t calls = frame->returns_top - returns.data();
+            if (calls >= Program::max_call_depth)
+                throw ProjectError("Program::execute(): call stack overflow");
+            if (calls == returns.size()) {
+                returns.resize(std::max<size_t>(64, 2 * calls));
+                frame->returns_top = returns.data() + calls;
+            }
+            *frame->returns_top++ = return_address;
+            auto &stack = *frame->stack;
+            const size_t position = base - stack.data();
+            if (stack.size() < position + frame->frame_size)
+                stack.resize(position + frame->frame_size);
+            frame->base = stack.data() + position;
+        });
+    }
+
+    int get(NativeFrame* frame, Variant* value, size_t) {
+        return guarded(frame, [&] {
+            auto result = value[0].get(value[1]);
+            if (result.has_value() == false)
+                throw ProjectError("cannot get index");
+            value[1] = Variant();
+            value[0] = std::move(result.value());
+        });
+    }
+
+    int set(NativeFrame* frame, Variant* object, size_t) {
+        return guarded(frame, [&] {
+            if (object[0].set(object[1], object[2]) == false)
+                throw ProjectError("cannot set index to value");
+            release_slots(frame, object + 1, 2);
+        });
+    }
+
+    /// Just enough of an x86-64 assembler for NativeCode. Memory operands are always
+    /// [rbx + displacement], rbx holding the first stack slot of the running function or of
+    /// the program, or [r12 + offset] for fields of the NativeFrame.
+    class Assembler {
+    public:
+        using Label = size_t;
+
+        enum Register : std::uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+        enum Condition : std::uint8_t {
+            BELOW = 0x2, EQUAL = 0x4, NOT_EQUAL = 0x5, ABOVE = 0x7, GREATER = 0xF, ALWAYS = 0xFF,
+        };
+        enum ScalarOperation : std::uint8_t { SCALAR_ADD = 0x58, SCALAR_MUL = 0x59, SCALAR_SUB = 0x5C };
+
+        Label new_label() {
+            labels.emplace_back();
+            return labels.size() - 1;
+        }
+
+        void bind(const Label label) { labels[label] = code.size(); }
+
+        void jump(const Condition condition, const Label label) {
+            if (condition == ALWAYS)
+                emit({0xE9});
+            else
+                emit({0x0F, static_cast<std::uint8_t>(0x80 | condition)});
+            fixups.emplace_back(code.size(), label);
+            emit32(0);
+        }
+
+        void prologue() {
+            emit({0x53, 0x41, 0x54, 0x55}); // push rbx; push r12; push rbp
+            emit({0x48, 0x89, 0xFB}); // mov rbx, rdi
+            emit({0x49, 0x89, 0xF4}); // mov r12, rsi
+        }
+
+        void epilogue(const int result) {
+            emit({0xB8});
+            emit32(static_cast<std::uint32_t>(result));
+            emit({0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop rbp; pop r12; pop rbx; ret
+        }
+
+        /// mov destination, [r12 + offset]
+        void load_frame(const Register destination, const std::uint8_t offset) {
+            emit({0x49, 0x8B, static_cast<std::uint8_t>(0x44 | destination << 3), 0x24, offset});
+        }
+
+        /// mov [r12 + offset], source
+        void store_frame(const std::uint8_t offset, const Register source) {
+            emit({0x49, 0x89, static_cast<std::uint8_t>(0x44 | source << 3), 0x24, offset});
+        }
+
+        /// lea destination, [rbx + displacement]
+        void address(const Register destination, const std::int32_t displacement) {
+            emit({0x48, 0x8D});
+            memory(destination, displacement);
+        }
+
+        /// sub rax, 8
+        void decrement_rax() { emit({0x48, 0x83, 0xE8, 0x08}); }
+        /// jmp [rax]
+        void jump_to_rax_target() { emit({0xFF, 0x20}); }
+
+        void load_tag(const Register destination, const std::int32_t displacement) {
+            emit({0x0F, 0xB6});
+            memory(destination, displacement);
+        }
+
+        void store_tag(const std::int32_t displacement, const Variant::Type tag) {
+            emit({0xC6});
+            memory(RAX, displacement);
+            emit({static_cast<std::uint8_t>(tag)});
+        }
+
+        void store_zero(const std::int32_t displacement) {
+            emit({0x48, 0xC7});
+            memory(RAX, displacement);
+            emit32(0);
+        }
+
+        void load(const Register destination, const std::int32_t displacement) {
+            emit({0x48, 0x8B});
+            memory(destination, displacement);
+        }
+
+        void store(const std::int32_t displacement, const Register source) {
+            emit({0x48, 0x89});
+            memory(source, displacement);
+        }
+
+        void move_immediate(const Register destination, const std::uint64_t value) {
+            emit({0x48, static_cast<std::uint8_t>(0xB8 | destination)});
+            emit64(value);
+        }
+
+        void compare_byte(const Register first, const Variant::Type value) {
+            emit({0x80, static_cast<std::uint8_t>(0xF8 | first), static_cast<std::uint8_t>(value)});
+        }
+
+        /// cmp eax, ecx
+        void compare_tags() { emit({0x39, 0xC8}); }
+        /// test rcx, rcx
+        void test_rcx() { emit({0x48, 0x85, 0xC9}); }
+        /// test eax, eax
+        void test_eax() { emit({0x85, 0xC0}); }
+
+        /// rax = rax operation rcx, wrapping on overflow
+        void integer_operation(const Program::InstructionType type) {
+            switch (type) {
+                case Program::OVERFLOW_ADD: emit({0x48, 0x01, 0xC8}); break;
+                case Program::OVERFLOW_SUB: emit({0x48, 0x29, 0xC8}); break;
+                case Program::OVERFLOW_MUL: emit({0x48, 0x0F, 0xAF, 0xC1}); break;
+                default: throw std::logic_error("Assembler::integer_operation: unsupported instruction");
+            }
+        }
+
+        void load_double(const std::uint8_t xmm, const std::int32_t displacement) {
+            emit({0xF2, 0x0F, 0x10});
+            memory(xmm, displacement);
+        }
+
+        void store_double(const std::int32_t displacement, const std::uint8_t xmm) {
+            emit({0xF2, 0x0F, 0x11});
+            memory(xmm, displacement);
+        }
+
+        /// xmm0 = xmm0 operation xmm1
+        void double_operation(const ScalarOperation operation) { emit({0xF2, 0x0F, operation, 0xC1}); }
+
+        /// Jumps to label when the bits in rcx are a double greater than zero.
+        void jump_if_rcx_positive_double(const Label label) {
+            emit({0x66, 0x48, 0x0F, 0x6E, 0xC1}); // movq xmm0, rcx
+            emit({0x66, 0x0F, 0x57, 0xC9}); // xorpd xmm1, xmm1
+            emit({0x66, 0x0F, 0x2E, 0xC1}); // ucomisd xmm0, xmm1
+            jump(ABOVE, label);
+        }
+
+        void load_slot(const std::uint8_t xmm, const std::int32_t displacement) {
+            emit({0xF3, 0x0F, 0x6F});
+            memory(xmm, displacement);
+        }
+
+        void store_slot(const std::int32_t displacement, const std::uint8_t xmm) {
+            emit({0xF3, 0x0F, 0x7F});
+            memory(xmm, displacement);
+        }
+
+        /// helper(frame, rbx + displacement, argument), the result is left in eax.
+        void call(const Helper helper, const std::int32_t displacement, const std::uint32_t argument) {
+            emit({0x4C, 0x89, 0xE7}); // mov rdi, r12
+            address(RSI, displacement);
+            emit({0xBA});
+            emit32(argument);
+            move_immediate(RAX, reinterpret_cast<std::uint64_t>(helper));
+            emit({0xFF, 0xD0});
+        }
+
+        /// helper(frame, rbx + displacement, address of label), the result is left in eax.
+        void call_with_address(const Helper helper, const std::int32_t displacement, const Label label) {
+            emit({0x4C, 0x89, 0xE7}); // mov rdi, r12
+            address(RSI, displacement);
+            emit({0x48, 0x8D, 0x15}); // lea rdx, [rip + label]
+            fixups.emplace_back(code.size(), label);
+            emit32(0);
+            move_immediate(RAX, reinterpret_cast<std::uint64_t>(helper));
+            emit({0xFF, 0xD0});
+        }
+
+        [[nodiscard]] std::vector<std::uint8_t> finish() {
+            for (const auto &[position, label] : fixups) {
+                const auto relative = static_cast<std::int32_t>(labels[label].value() - (position + 4));
+                std::memcpy(code.data() + position, &relative, sizeof(relative));
+            }
+            return std::move(code);
+        }
+
+    private:
+        std::vector<std::uint8_t> code;
+        std::vector<std::optional<size_t>> labels;
+        std::vector<std::pair<size_t, Label>> fixups;
+
+        void emit(const std::initializer_list<std::uint8_t> bytes) { code.insert(code.end(), bytes); }
+
+        void emit32(const std::uint32_t value) {
+            for (size_t i = 0; i < 4; ++i)
+                code.push_back(static_cast<std::uint8_t>(value >> 8 * i));
+        }
+
+        void emit64(const std::uint64_t value) {
+            emit32(static_cast<std::uint32_t>(value));
+            emit32(static_cast<std::uint32_t>(value >> 32));
+        }
+
+        /// ModRM for [rbx + disp32] with the given register field.
+        void memory(const std::uint8_t reg, const std::int32_t displacement) {
+            emit({static_cast<std::uint8_t>(0x80 | (reg & 7) << 3 | RBX)});
+            emit32(static_cast<std::uint32_t>(displacement));
+        }
+    };
+
+}
+
+std::unique_ptr<NativeCode> NativeCode::compile(const Program &program, const std::vector<size_t> &depths,
+    const std::vector<size_t> &functions) {
+#if PROJECT_NATIVE_CODE
+    static_assert(sizeof(Variant) == 16);
+    static_assert(offsetof(Variant, tag) == 0 && offsetof(Variant, payload) == 8);
+    using enum Variant::Type;
+    const auto &instructions = program.instructions;
+    const size_t max_depth = depths.empty() ? 0 : *std::max_element(depths.begin(), depths.end());
+    if (max_depth + 1 > static_cast<size_t>(std::numeric_limits<std::int32_t>::max()) / sizeof(Variant))
+        return nullptr;
+
+    Assembler assembler;
+    std::vector<Assembler::Label> instruction_labels;
+    for (size_t i = 0; i <= instructions.size(); ++i)
+        instruction_labels.push_back(assembler.new_label());
+    // One exit per failing depth, storing it for NativeCode::execute.
+    std::map<size_t, Assembler::Label> error_exits;
+    const auto slot = [](const size_t index) { return static_cast<std::int32_t>(index * sizeof(Variant)); };
+    const auto payload = [&](const size_t index) { return slot(index) + 8; };
+    const auto checked_call = [&](const Helper helper, const size_t index, const size_t argument, const size_t depth) {
+        assembler.call(helper, slot(index), static_cast<std::uint32_t>(argument));
+        assembler.test_eax();
+        if (error_exits.contains(depth) == false)
+            error_exits[depth] = assembler.new_label();
+        assembler.jump(Assembler::NOT_EQUAL, error_exits[depth]);
+    };
+    const auto jump_if_heap = [&](const Assembler::Register tag, const Assembler::Label label) {
+        assembler.compare_byte(tag, FUNCTION);
+        assembler.jump(Assembler::EQUAL, label);
+        assembler.compare_byte(tag, MAP);
+        assembler.jump(Assembler::EQUAL, label);
+    };
+    const auto release = [&](const size_t index) {
+        const auto heap = assembler.new_label();
+        const auto done = assembler.new_label();
+        assembler.load_tag(Assembler::RAX, slot(index));
+        jump_if_heap(Assembler::RAX, heap);
+        assembler.store_tag(slot(index), UNIT);
+        assembler.store_zero(payload(index));
+        assembler.jump(Assembler::ALWAYS, done);
+        assembler.bind(heap);
+        assembler.call(release_slots, slot(index), 1);
+        assembler.bind(done);
+    };
+
+    assembler.prologue();
+    for (size_t index = 0; index < instructions.size(); ++index) {
+        assembler.bind(instruction_labels[index]);
+        const auto [type, argument] = instructions[index];
+        const size_t depth = depths[index];
+        switch (type) {
+            case Program::PUSH_IMMEDIATE:
+                assembler.store_tag(slot(depth), UNSIGNED);
+                assembler.move_immediate(Assembler::RAX, argument);
+                assembler.store(payload(depth), Assembler::RAX);
+                break;
+            case Program::PUSH_CONST: {
+                const auto &constant = program.constants[argument];
+                if (constant.is_inlined()) {
+                    assembler.store_tag(slot(depth), constant.tag);
+                    assembler.move_immediate(Assembler::RAX, constant.payload);
+                    assembler.store(payload(depth), Assembler::RAX);
+                }
+                else
+                    assembler.call(copy_constant, slot(depth), argument);
+            } break;
+            case Program::PUSH_STACK: {
+                const size_t source = depth - 1 - argument;
+                const auto heap = assembler.new_label();
+                const auto done = assembler.new_label();
+                assembler.load_tag(Assembler::RAX, slot(source));
+                jump_if_heap(Assembler::RAX, heap);
+                assembler.load_slot(0, slot(source));
+                assembler.store_slot(slot(depth), 0);
+                assembler.jump(Assembler::ALWAYS, done);
+                assembler.bind(heap);
+                assembler.call(copy_slot, slot(depth), argument);
+                assembler.bind(done);
+            } break;
+            case Program::PUSH_GLOBAL:
+                checked_call(push_global, depth - 1, 0, depth);
+                break;
+            case Program::SWAP:
+                if (argument == 0)
+                    break;
+                assembler.load_slot(0, slot(depth - 1));
+                assembler.load_slot(1, slot(depth - 1 - argument));
+                assembler.store_slot(slot(depth - 1), 1);
+                assembler.store_slot(slot(depth - 1 - argument), 0);
+                break;
+            case Program::POP:
+                if (argument > 4)
+                    assembler.call(release_slots, slot(depth - argument), argument);
+                else
+                    for (size_t i = depth - argument; i < depth; ++i)
+                        release(i);
+                break;
+            case Program::DELETE:
+                release(depth - 1 - argument);
+                break;
+            case Program::OVERFLOW_ADD:
+            case Program::OVERFLOW_SUB:
+            case Program::OVERFLOW_MUL: {
+                const size_t first = depth - 2;
+                const size_t second = depth - 1;
+                const auto floating_point = assembler.new_label();
+                const auto generic = assembler.new_label();
+                const auto clear = assembler.new_label();
+                const auto done = assembler.new_label();
+                assembler.load_tag(Assembler::RAX, slot(first));
+                assembler.load_tag(Assembler::RCX, slot(second));
+                assembler.compare_tags();
+                assembler.jump(Assembler::NOT_EQUAL, generic);
+                assembler.compare_byte(Assembler::RAX, SIGNED);
+                assembler.jump(Assembler::ABOVE, floating_point);
+                assembler.load(Assembler::RAX, payload(first));
+                assembler.load(Assembler::RCX, payload(second));
+                assembler.integer_operation(type);
+                assembler.store(payload(first), Assembler::RAX);
+                assembler.jump(Assembler::ALWAYS, clear);
+                assembler.bind(floating_point);
+                assembler.compare_byte(Assembler::RAX, FLOATING_POINT);
+                assembler.jump(Assembler::NOT_EQUAL, generic);
+                assembler.load_double(0, payload(first));
+                assembler.load_double(1, payload(second));
+                assembler.double_operation(type == Program::OVERFLOW_ADD ? Assembler::SCALAR_ADD
+                    : type == Program::OVERFLOW_SUB ? Assembler::SCALAR_SUB : Assembler::SCALAR_MUL);
+                assembler.store_double(payload(first), 0);
+                assembler.jump(Assembler::ALWAYS, clear);
+                assembler.bind(generic);
+                checked_call(type == Program::OVERFLOW_ADD ? arithmetic<&Variant::overflow_add>
+                    : type == Program::OVERFLOW_SUB ? arithmetic<&Variant::overflow_sub>
+                    : arithmetic<&Variant::overflow_mul>, first, 0, depth);
+                assembler.jump(Assembler::ALWAYS, done);
+                assembler.bind(clear);
+                assembler.store_tag(slot(second), UNIT);
+                assembler.store_zero(payload(second));
+                assembler.bind(done);
+            } break;
+            case Program::OVERFLOW_DIV:
+                checked_call(arithmetic<&Variant::overflow_div>, depth - 2, 0, depth);
+                break;
+            case Program::OVERFLOW_MOD:
+                checked_call(arithmetic<&Variant::overflow_mod>, depth - 2, 0, depth);
+                break;
+            case Program::OR_ELSE:
+                checked_call(logical<&Variant::or_else>, depth - 2, 0, depth);
+                break;
+            case Program::AND_ELSE:
+                checked_call(logical<&Variant::and_else>, depth - 2, 0, depth);
+                break;
+            case Program::CALL:
+                checked_call(call, depth - 1 - argument, argument, depth);
+                break;
+            case Program::GET:
+                checked_call(get, depth - 2, 0, depth);
+                break;
+            case Program::SET:
+                checked_call(set, depth - 3, 0, depth);
+                break;
+            case Program::CALL_LOCAL: {
+                // The callee continues with its frame in rbx, the code after the jump moves rbx
+                // back to the frame of the caller when it returns.
+                const size_t frame_start = depth - Program::call_arguments(argument);
+                const auto returned = assembler.new_label();
+                assembler.call_with_address(enter_call, slot(frame_start), returned);
+                assembler.test_eax();
+                if (error_exits.contains(depth) == false)
+                    error_exits[depth] = assembler.new_label();
+                assembler.jump(Assembler::NOT_EQUAL, error_exits[depth]);
+                assembler.load_frame(Assembler::RBX, offsetof(NativeFrame, base));
+                assembler.jump(Assembler::ALWAYS, instruction_labels[Program::call_target(argument)]);
+                assembler.bind(returned);
+                if (frame_start > 0)
+                    assembler.address(Assembler::RBX, -slot(frame_start));
+            } break;
+            case Program::RETURN: {
+                const size_t result = depth - 1 - argument;
+                for (size_t i = result; i < depth - 1; ++i)
+                    release(i);
+                if (argument > 0) {
+                    assembler.load_slot(0, slot(depth - 1));
+                    assembler.store_slot(slot(result), 0);
+                    assembler.store_tag(slot(depth - 1), UNIT);
+                    assembler.store_zero(payload(depth - 1));
+                }
+                if (functions[index] == 0) {
+                    assembler.jump(Assembler::ALWAYS, instruction_labels[instructions.size()]);
+                    break;
+                }
+                assembler.load_frame(Assembler::RAX, offsetof(NativeFrame, returns_top));
+                assembler.decrement_rax();
+                assembler.store_frame(offsetof(NativeFrame, returns_top), Assembler::RAX);
+                assembler.jump_to_rax_target();
+            } break;
+            case Program::TAIL_CALL_LOCAL:
+                // The frame holds just the arguments, the callee takes it over as it is.
+                assembler.jump(Assembler::ALWAYS, instruction_labels[Program::call_target(argument)]);
+                break;
+            case Program::JUMP_IF_POSITIVE: {
+                const size_t top = depth - 1;
+                const auto target = instruction_labels[argument];
+                const auto next = instruction_labels[index + 1];
+                const auto heap = assembler.new_label();
+                const auto not_unsigned = assembler.new_label();
+                const auto not_signed = assembler.new_label();
+                assembler.load_tag(Assembler::RAX, slot(top));
+                jump_if_heap(Assembler::RAX, heap);
+                // The popped slot becomes Unit before the comparison, mov leaves the flags alone.
+                assembler.load(Assembler::RCX, payload(top));
+                assembler.store_tag(slot(top), UNIT);
+                assembler.store_zero(payload(top));
+                assembler.compare_byte(Assembler::RAX, UNSIGNED);
+                assembler.jump(Assembler::NOT_EQUAL, not_unsigned);
+                assembler.test_rcx();
+                assembler.jump(Assembler::NOT_EQUAL, target);
+                assembler.jump(Assembler::ALWAYS, next);
+                assembler.bind(not_unsigned);
+                assembler.compare_byte(Assembler::RAX, SIGNED);
+                assembler.jump(Assembler::NOT_EQUAL, not_signed);
+                assembler.test_rcx();
+                assembler.jump(Assembler::GREATER, target);
+                assembler.jump(Assembler::ALWAYS, next);
+                assembler.bind(not_signed);
+                assembler.compare_byte(Assembler::RAX, FLOATING_POINT);
+                assembler.jump(Assembler::NOT_EQUAL, next);
+                assembler.jump_if_rcx_positive_double(target);
+                assembler.jump(Assembler::ALWAYS, next);
+                assembler.bind(heap);
+                assembler.call(release_slots, slot(top), 1);
+            } break;
+            default:
+                return nullptr;
+        }
+    }
+    assembler.bind(instruction_labels[instructions.size()]);
+    assembler.epilogue(0);
+    for (const auto &[depth, label] : error_exits) {
+        assembler.bind(label);
+        assembler.address(Assembler::RAX, slot(depth));
+        assembler.store_frame(offsetof(NativeFrame, error_top), Assembler::RAX);
+        assembler.epilogue(1);
+    }
+    const auto code = assembler.finish();
+
+    const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t memory_size = (code.size() + page_size - 1) / page_size * page_size;
+    void* memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, memory_size);
+        throw std::runtime_error("NativeCode::compile: cannot make code executable");
+    }
+    return std::unique_ptr<NativeCode>(new NativeCode(memory, memory_size, code.size(), max_depth, depths.back()));
+#else
+    return nullptr;
+#endif
+}
+
+NativeCode::~NativeCode() {
+#if PROJECT_NATIVE_CODE
+    munmap(memory, memory_size);
+#endif
+}
+
+void NativeCode::execute(const Program &program, std::vector<Variant> &stack) const {
+#if PROJECT_NATIVE_CODE
+    // Slots above the current depth hold Unit, so the generated code never releases them.
+    const size_t entry = stack.size();
+    stack.resize(entry + max_depth);
+    NativeFrame frame;
+    frame.stack = &stack;
+    frame.program = &program;
+    frame.frame_size = max_depth;
+    const auto function = reinterpret_cast<int (*)(Variant*, NativeFrame*)>(memory);
+    if (function(stack.data() + entry, &frame) != 0) {
+        // Frames of the functions being called stay below the failing instruction.
+        stack.resize(frame.error_top - stack.data());
+        std::rethrow_exception(frame.error);
+    }
+    stack.resize(entry + final_depth);
+#else
+    throw std::logic_error("NativeCode::execute(): native code is not supported on this platform");
+#endif
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Program.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define PROJECT_NATIVE_CODE 1
+#else
+#define PROJECT_NATIVE_CODE 0
+#endif
+
+namespace project {
+
+    /// x86-64 machine code translated from a verified Program, see Program::compile_native().
+    /// Every instruction works on stack slots at the depth proven by the verifier. Numbers,
+    /// pushes, SWAP, POP and JUMP_IF_POSITIVE are emitted inline, maps, functions and
+    /// mixed type arithmetic call back into the Variant runtime. Local functions address
+    /// their own frame, CALL_LOCAL keeps the return addresses outside of the machine stack
+    /// so recursion is bounded by Program::max_call_depth as in the interpreter.
+    class NativeCode {
+    public:
+        /// Returns nullptr when the platform has no native code or the program uses an
+        /// instruction without a translation. depths holds the stack depth of every
+        /// instruction and of the end of the program, relative to the depth at entry or to
+        /// the frame of its function, and functions the entry of that function, see
+        /// Program::verified_depths() and Program::verified_functions().
+        static std::unique_ptr<NativeCode> compile(const Program& program, const std::vector<size_t>& depths,
+            const std::vector<size_t>& functions);
+
+        NativeCode(const NativeCode&) = delete;
+        NativeCode& operator=(const NativeCode&) = delete;
+        ~NativeCode();
+
+        /// Runs the code on top of stack. When an instruction throws, the stack holds the
+        /// values present before it and the exception is rethrown.
+        void execute(const Program& program, std::vector<Variant>& stack) const;
+        [[nodiscard]] size_t size() const { return code_size; }
+
+    private:
+        NativeCode(void* memory, size_t memory_size, size_t code_size, size_t max_depth, size_t final_depth)
+            : memory(memory), memory_size(memory_size), code_size(code_size),
+            max_depth(max_depth), final_depth(final_depth) {}
+
+        void* memory;
+        size_t memory_size;
+        size_t code_size;
+        size_t max_depth;
+        size_t final_depth;
+    };
+
+}
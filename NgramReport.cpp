@@ -0,0 +1,48 @@
+#include <fstream>
+#include <iostream>
+
+#include "BytecodeStatistics.h"
+#include "ProgramBuilder.h"
+
+using namespace project;
+
+// Compiles every script given on the command line and prints the most frequent
+// instruction sequences, candidates for the superinstructions fused by Program,
+// how many constants the pools stored and how many instructions the peephole pass removed.
+int main(const int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " script...\n";
+        return 1;
+    }
+    std::vector<NgramCounter> counters = {NgramCounter(2), NgramCounter(3), NgramCounter(4)};
+    size_t compiled = 0;
+    ConstantPoolStatistics constants;
+    PeepholeStatistics peephole;
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file(argv[i]);
+        if (file.is_open() == false) {
+            std::cerr << argv[i] << ": cannot open\n";
+            continue;
+        }
+        try {
+            ProgramBuilder builder;
+            builder.compile(file);
+            const auto statistics = builder.constant_pool_statistics();
+            constants.requested += statistics.requested;
+            constants.stored += statistics.stored;
+            const auto program = builder.build();
+            peephole.emitted += builder.peephole_statistics().emitted;
+            peephole.built += builder.peephole_statistics().built;
+            for (auto &counter : counters)
+                counter.add(program);
+            compiled++;
+        }
+        catch (const std::exception &error) {
+            std::cerr << argv[i] << ": " << error.what() << '\n';
+        }
+    }
+    std::cout << compiled << " programs, " << constants << ", " << peephole << '\n';
+    for (const auto &counter : counters)
+        counter.report(std::cout, 10);
+    return 0;
+}
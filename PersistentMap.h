@@ -0,0 +1,210 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "FlatMap.h"
+
+namespace project {
+
+    /// Map with integer keys and value semantics. The keys 0, 1, 2, ... present from zero up are
+    /// dense and live in fixed size chunks indexed directly, every other key lives in a FlatMap.
+    /// Copies share the chunks and the FlatMap, insert_or_assign() copies a chunk or the FlatMap
+    /// only while it is shared, so copying a map is O(1), layering versions of a large dense map
+    /// stays cheap and building one is O(n).
+    template<std::integral KEY, class VALUE, class ALLOCATOR = std::allocator<VALUE>>
+    class PersistentMap {
+    public:
+        /// What iteration yields, dense values have no stored entry.
+        struct Item {
+            KEY key;
+            const VALUE& value;
+        };
+
+        class Iterator;
+
+        PersistentMap() = default;
+
+        [[nodiscard]] size_t size() const { return dense_count + sparse_keys().size(); }
+        [[nodiscard]] bool empty() const { return size() == 0; }
+        /// Number of keys stored in the dense chunks.
+        [[nodiscard]] size_t dense_size() const { return dense_count; }
+
+        [[nodiscard]] const VALUE* find(const KEY key) const {
+            if (is_dense(key))
+                return &dense_value(static_cast<size_t>(key));
+            return sparse_keys().find(key);
+        }
+        [[nodiscard]] bool contains(const KEY key) const { return find(key) != nullptr; }
+        [[nodiscard]] const VALUE& at(KEY key) const;
+
+        /// Returns true when the key was not present before.
+        bool insert_or_assign(KEY key, VALUE value);
+
+        [[nodiscard]] Iterator begin() const { return Iterator(*this); }
+        [[nodiscard]] Iterator end() const { return Iterator(); }
+
+        /// Copy that shares nothing with this map, every value replaced by functor(value).
+        template<class FUNCTOR>
+        [[nodiscard]] PersistentMap transformed(FUNCTOR&& functor) const;
+
+        bool operator==(const PersistentMap& other) const;
+
+    private:
+        static constexpr size_t chunk_size = 32;
+
+        using Chunk = std::array<VALUE, chunk_size>;
+        using ChunkAllocator = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<Chunk>;
+        using ChunksAllocator = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<std::shared_ptr<Chunk>>;
+        using Sparse = FlatMap<KEY, VALUE, ALLOCATOR>;
+        using SparseAllocator = typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<Sparse>;
+
+        /// Values of the keys below dense_count.
+        std::vector<std::shared_ptr<Chunk>, ChunksAllocator> chunks;
+        size_t dense_count = 0;
+        /// Keys outside the dense range, never the key dense_count. Null until there is one.
+        std::shared_ptr<Sparse> sparse;
+
+        [[nodiscard]] bool is_dense(const KEY key) const {
+            return static_cast<std::make_unsigned_t<KEY>>(key) < dense_count;
+        }
+
+        [[nodiscard]] const VALUE& dense_value(const size_t index) const {
+            return (*chunks[index / chunk_size])[index % chunk_size];
+        }
+
+        [[nodiscard]] const Sparse& sparse_keys() const {
+            static const Sparse none;
+            return sparse != nullptr ? *sparse : none;
+        }
+
+        VALUE& mutable_dense_value(size_t index);
+        Sparse& mutable_sparse();
+        void append_dense(VALUE value);
+
+    public:
+        /// Visits the dense keys in order, then the sparse keys.
+        class Iterator {
+        public:
+            using value_type = Item;
+            using difference_type = std::ptrdiff_t;
+            using reference = Item;
+            using iterator_category = std::input_iterator_tag;
+
+            Iterator() = default;
+            explicit Iterator(const PersistentMap& map) : map(&map), sparse(map.sparse_keys().begin()) {}
+
+            reference operator*() const {
+                if (dense < map->dense_count)
+                    return {static_cast<KEY>(dense), map->dense_value(dense)};
+                return {sparse->key, sparse->value};
+            }
+            Iterator& operator++() {
+                if (dense < map->dense_count)
+                    dense++;
+                else
+                    ++sparse;
+                return *this;
+            }
+            Iterator operator++(int) {
+                auto old = *this;
+                ++*this;
+                return old;
+            }
+            bool operator==(const Iterator& other) const {
+                if (at_end() || other.at_end())
+                    return at_end() == other.at_end();
+                return &(**this).value == &(*other).value;
+            }
+
+        private:
+            const PersistentMap* map = nullptr;
+            size_t dense = 0;
+            typename Sparse::Iterator sparse;
+
+            [[nodiscard]] bool at_end() const {
+                return map == nullptr || (dense >= map->dense_count && sparse == map->sparse_keys().end());
+            }
+        };
+    };
+
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+const VALUE& project::PersistentMap<KEY, VALUE, ALLOCATOR>::at(const KEY key) const {
+    const auto value = find(key);
+    if (value == nullptr)
+        throw std::out_of_range("PersistentMap::at: key not found");
+    return *value;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+bool project::PersistentMap<KEY, VALUE, ALLOCATOR>::insert_or_assign(const KEY key, VALUE value) {
+    if (is_dense(key)) {
+        mutable_dense_value(static_cast<size_t>(key)) = std::move(value);
+        return false;
+    }
+    if (std::cmp_not_equal(key, dense_count))
+        return mutable_sparse().insert_or_assign(key, std::move(value));
+    append_dense(std::move(value));
+    // Sparse keys continuing the dense range become dense too.
+    while (sparse_keys().find(static_cast<KEY>(dense_count)) != nullptr)
+        append_dense(std::move(*mutable_sparse().extract(static_cast<KEY>(dense_count))));
+    return true;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+VALUE& project::PersistentMap<KEY, VALUE, ALLOCATOR>::mutable_dense_value(const size_t index) {
+    auto &chunk = chunks[index / chunk_size];
+    if (chunk.use_count() != 1)
+        chunk = std::allocate_shared<Chunk>(ChunkAllocator(), *chunk);
+    return (*chunk)[index % chunk_size];
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+typename project::PersistentMap<KEY, VALUE, ALLOCATOR>::Sparse&
+project::PersistentMap<KEY, VALUE, ALLOCATOR>::mutable_sparse() {
+    if (sparse == nullptr)
+        sparse = std::allocate_shared<Sparse>(SparseAllocator());
+    else if (sparse.use_count() != 1)
+        sparse = std::allocate_shared<Sparse>(SparseAllocator(), *sparse);
+    return *sparse;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+void project::PersistentMap<KEY, VALUE, ALLOCATOR>::append_dense(VALUE value) {
+    if (dense_count % chunk_size == 0)
+        chunks.push_back(std::allocate_shared<Chunk>(ChunkAllocator()));
+    mutable_dense_value(dense_count++) = std::move(value);
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+template<class FUNCTOR>
+project::PersistentMap<KEY, VALUE, ALLOCATOR>
+project::PersistentMap<KEY, VALUE, ALLOCATOR>::transformed(FUNCTOR&& functor) const {
+    PersistentMap result;
+    result.chunks.reserve(chunks.size());
+    for (size_t index = 0; index < dense_count; ++index)
+        result.append_dense(functor(dense_value(index)));
+    if (sparse != nullptr)
+        result.sparse = std::allocate_shared<Sparse>(SparseAllocator(), sparse->transformed(functor));
+    return result;
+}
+
+template<std::integral KEY, class VALUE, class ALLOCATOR>
+bool project::PersistentMap<KEY, VALUE, ALLOCATOR>::operator==(const PersistentMap &other) const {
+    if (size() != other.size())
+        return false;
+    for (const auto &[key, value] : *this) {
+        const auto found = other.find(key);
+        if (found == nullptr || !(*found == value))
+            return false;
+    }
+    return true;
+}
@@ -3,51 +3,72 @@
 //
 
 #include "Program.h"
+#include "NativeCode.h"
+#include "Tracer.h"
+#include <algorithm>
 
-#include <iostream>
 #include <span>
 #include <stdexcept>
 
-#define BINARY_OPERATION(opr, call) case opr: { \
-Variant second___ {pop(stack)};             \
-Variant first___ {pop(stack)};              \
-stack.push_back(call(first___, second___)); \
-} break
-
 using namespace project;
 
-Variant::Variant() : data(Unit()) {}
-
-Variant::Variant(long long value) : data(value) {}
-
-Variant::Variant(size_t value) : data(value) {}
+Variant::Variant(function func)
+    : Variant([func = std::move(func)](const std::span<Variant> arguments) { return func(arguments[0]); }, 1)
+{}
 
-Variant::Variant(double value) : data(value) {}
+Variant::Variant(native_function func, const size_t arity) : tag(Type::FUNCTION) {
+    auto *cell = new (ExecutionArena::allocate(sizeof(FunctionCell))) FunctionCell;
+    cell->value = std::move(func);
+    cell->arity = arity;
+    payload = reinterpret_cast<std::uintptr_t>(static_cast<HeapCell*>(cell));
+}
 
-Variant::Variant(function func) : data(std::move(func)) {}
+Variant::Variant(map map) : tag(Type::MAP) {
+    auto *cell = new (ExecutionArena::allocate(sizeof(MapCell))) MapCell;
+    cell->value = std::move(map);
+    payload = reinterpret_cast<std::uintptr_t>(static_cast<HeapCell*>(cell));
+}
 
-Variant::Variant(map map) : data(std::move(map)) {}
+void Variant::release() {
+    if (cell()->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if (tag == Type::FUNCTION) {
+        std::destroy_at(function_cell());
+        ExecutionArena::deallocate(function_cell(), sizeof(FunctionCell));
+    }
+    else {
+        std::destroy_at(map_cell());
+        ExecutionArena::deallocate(map_cell(), sizeof(MapCell));
+    }
+}
 
-bool Variant::is_inlined() const {
-    return true;
+Variant::map & Variant::mutable_map() {
+    assert(tag == Type::MAP);
+    if (map_cell()->references.load(std::memory_order_acquire) != 1)
+        *this = Variant(map_cell()->value);
+    return map_cell()->value;
 }
 
 bool Variant::jumps_on_jump_if_positive() const {
-    return std::visit([]<class T>(const T& self) -> bool {
-        if constexpr (std::is_arithmetic_v<T>) {
-            return self > 0;
-        }
-        return false;
-    }, data);
+    switch (tag) {
+        case Type::UNSIGNED:
+            return payload > 0;
+        case Type::SIGNED:
+            return std::bit_cast<long long>(payload) > 0;
+        case Type::FLOATING_POINT:
+            return std::bit_cast<double>(payload) > 0;
+        default:
+            return false;
+    }
 }
 
 template<typename FUNCTOR>
-static auto double_visit(FUNCTOR func, const Variant::variant &first, const Variant::variant &second) -> decltype(func(first, second)) {
-    return std::visit([&](auto& a) {
-        return std::visit([&](auto& b) {
+static auto double_visit(FUNCTOR func, const Variant &first, const Variant &second) {
+    return first.visit([&](auto& a) {
+        return second.visit([&](auto& b) {
             return func(a, b);
-        }, second);
-    }, first);
+        });
+    });
 }
 
 
@@ -60,7 +81,7 @@ std::optional<Variant> Variant::overflow_add(const Variant &other) const {
             || std::is_floating_point_v<T1> && std::is_floating_point_v<T2>)
             return std::make_optional(Variant::floating_point(a + b));
         return std::nullopt;
-    }, data, other.data);
+    }, *this, other);
 }
 
 std::optional<Variant> Variant::overflow_sub(const Variant &other) const {
@@ -72,7 +93,7 @@ std::optional<Variant> Variant::overflow_sub(const Variant &other) const {
             || std::is_floating_point_v<T1> && std::is_floating_point_v<T2>)
             return std::make_optional(Variant::floating_point(a - b));
         return std::nullopt;
-    }, data, other.data);
+    }, *this, other);
 }
 
 std::optional<Variant> Variant::overflow_mul(const Variant &other) const {
@@ -84,7 +105,7 @@ std::optional<Variant> Variant::overflow_mul(const Variant &other) const {
             || std::is_floating_point_v<T1> && std::is_floating_point_v<T2>)
             return std::make_optional(Variant::floating_point(a * b));
         return std::nullopt;
-    }, data, other.data);
+    }, *this, other);
 }
 
 std::optional<Variant> Variant::overflow_div(const Variant &other) const {
@@ -96,7 +117,7 @@ std::optional<Variant> Variant::overflow_div(const Variant &other) const {
             || std::is_floating_point_v<T1> && std::is_floating_point_v<T2>)
             return std::make_optional(Variant::floating_point(a / b));
         return std::nullopt;
-    }, data, other.data);
+    }, *this, other);
 }
 
 std::optional<Variant> Variant::overflow_mod(const Variant &other) const {
@@ -104,11 +125,11 @@ std::optional<Variant> Variant::overflow_mod(const Variant &other) const {
         if constexpr (std::is_integral_v<T1> && std::is_integral_v<T2>)
             return std::make_optional(Variant::integer(a % b));
         return std::nullopt;
-    }, data, other.data);
+    }, *this, other);
 }
 
 std::optional<Variant> Variant::negate() const {
-    return std::visit([]<class T>(const T& self) -> std::optional<Variant> {
+    return visit([]<class T>(const T& self) -> std::optional<Variant> {
         if constexpr (std::is_integral_v<T>) {
             return { Variant(-static_cast<long long>(self)) };
         }
@@ -116,102 +137,141 @@ std::optional<Variant> Variant::negate() const {
             return { Variant(-self) };
         }
         return std::nullopt;
-    }, data);
+    });
 }
 
-std::optional<Variant> Variant::get(const Variant &index) const {
-    return std::visit([&]<class T>(const T& self) -> std::optional<Variant> {
-        if constexpr (std::is_same_v<T, map>) {
-            auto true_index = std::visit([&]<class U>(const U& index_self)
-                -> std::optional<map_index> {
-                if constexpr (std::is_integral_v<U>) {
-                    return { index_self };
-                }
-                return std::nullopt;
-            }, index.data);
-            if (true_index.has_value() && self.contains(true_index.value()))
-                return { *self.at(true_index.value()) };
-            return std::nullopt;
+static std::optional<Variant::map_index> to_map_index(const Variant &index) {
+    return index.visit([&]<class U>(const U& index_self) -> std::optional<Variant::map_index> {
+        if constexpr (std::is_integral_v<U>) {
+            return { index_self };
         }
         return std::nullopt;
-    }, data);
+    });
+}
+
+std::optional<Variant> Variant::get(const Variant &index) const {
+    if (tag != Type::MAP)
+        return std::nullopt;
+    const auto true_index = to_map_index(index);
+    if (true_index.has_value() == false)
+        return std::nullopt;
+    if (const auto found = map_cell()->value.find(true_index.value()))
+        return { *found };
+    return std::nullopt;
 }
 
 bool Variant::set(const Variant &index, Variant value) {
-    return std::visit([&]<class T>(T& self) -> bool {
-        if constexpr (std::is_same_v<T, map>) {
-            auto true_index = std::visit([&]<class U>(const U& index_self)
-                -> std::optional<map_index> {
-                if constexpr (std::is_integral_v<U>) {
-                    return { index_self };
-                }
-                return std::nullopt;
-            }, index.data);
-            if (true_index.has_value()) {
-                self[true_index.value()] = std::make_shared<Variant>(std::move(value));
-                return true;
-            }
-            return false;
-        }
+    if (tag != Type::MAP)
+        return false;
+    const auto true_index = to_map_index(index);
+    if (true_index.has_value() == false)
         return false;
-    }, data);
+    mutable_map().insert_or_assign(true_index.value(), std::move(value));
+    return true;
 }
 
 Variant Variant::or_else(const Variant &other) const {
-    return std::visit([&]<class T>(const T&) {
-        if constexpr (std::is_same_v<T, Unit>)
-            return other;
-        return *this;
-    }, data);
+    if (tag == Type::UNIT)
+        return other;
+    return *this;
 }
 
 Variant Variant::and_else(const Variant &other) const {
-    return std::visit([&]<class T>(const T&) {
-        if constexpr (std::is_same_v<T, Unit>)
-            return *this;
-        return other;
-    }, data);
+    if (tag == Type::UNIT)
+        return *this;
+    return other;
 }
 
 std::optional<size_t> Variant::try_to_index() const {
-    return std::visit([]<class T>(const T& self) -> std::optional<size_t> {
+    return visit([]<class T>(const T& self) -> std::optional<size_t> {
         if constexpr (std::is_integral_v<T> || std::is_floating_point_v<T>)
             return { static_cast<size_t>(self) };
         return std::nullopt;
-   }, data);
+   });
 }
 
 void Variant::unchecked_delete() {
-    std::visit([](auto&& self) {
-        /* delete pointer */
-    }, data);
-    data = Unit();
+    *this = Variant();
 }
 
 Variant Variant::call(const std::span<Variant>& arguments) {
-    return std::visit<std::optional<Variant>>([&]<class T>(T& self) -> std::optional<Variant> {
-        if constexpr (std::is_same_v<T, function>) {
-            auto result = self(arguments[0]);
-            if (arguments.size() == 1)
-                return result;
-            return result.call(arguments.subspan(1));
-        }
-        return std::nullopt;
-    }, data).value();
+    if (tag != Type::FUNCTION)
+        throw std::bad_optional_access();
+    const size_t arity = function_cell()->arity;
+    if (arguments.size() < arity) {
+        // Only a partial application allocates a closure, it keeps the arguments until the
+        // call passing the rest of them.
+        std::vector<Variant> bound(arguments.begin(), arguments.end());
+        return {[callable = *this, bound = std::move(bound)](const std::span<Variant> rest) mutable {
+            auto all = bound;
+            all.insert(all.end(), std::make_move_iterator(rest.begin()), std::make_move_iterator(rest.end()));
+            return callable.call(all);
+        }, arity - arguments.size()};
+    }
+    auto result = function_cell()->value(arguments.first(arity));
+    if (arguments.size() == arity)
+        return result;
+    return result.call(arguments.subspan(arity));
 }
 
 bool Variant::operator==(const Variant &other) const {
     return double_visit([]<class T1, class T2>(const T1& first, const T2& second) -> bool {
-        if constexpr (std::is_same_v<T1, function> && std::is_same_v<T2, function>)
+        if constexpr (std::is_same_v<T1, native_function> && std::is_same_v<T2, native_function>)
             return &first == &second;
         else if constexpr ((std::is_integral_v<T1> || std::is_floating_point_v<T1>)
             && (std::is_integral_v<T2> || std::is_floating_point_v<T2>)
             || std::is_same_v<T1, T2>)
             return first == second;
         return false;
-    }, data, other.data);
+    }, *this, other);
 }
 
+bool Variant::is_identical(const Variant &other) const {
+    if (tag != other.tag)
+        return false;
+    switch (tag) {
+        case Type::UNIT:
+            return true;
+        case Type::MAP: {
+            if (cell() == other.cell())
+                return true;
+            const auto &first = map_cell()->value;
+            const auto &second = other.map_cell()->value;
+            if (first.size() != second.size())
+                return false;
+            for (const auto &[key, value] : first) {
+                const auto found = second.find(key);
+                if (found == nullptr || value.is_identical(*found) == false)
+                    return false;
+            }
+            return true;
+        }
+        default:
+            return payload == other.payload;
+    }
+}
+
+static size_t mix(std::uint64_t value) {
+    value = (value ^ value >> 30) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ value >> 27) * 0x94d049bb133111ebULL;
+    return value ^ value >> 31;
+}
+
+size_t Variant::hash() const {
+    switch (tag) {
+        case Type::UNIT:
+            return mix(static_cast<std::uint64_t>(tag));
+        case Type::MAP: {
+            // Summed, identical maps can iterate their sparse keys in a different order.
+            auto result = static_cast<std::uint64_t>(map_cell()->value.size());
+            for (const auto &[key, value] : map_cell()->value)
+                result += mix(static_cast<std::uint64_t>(key) ^ value.hash());
+            return mix(result ^ static_cast<std::uint64_t>(tag));
+        }
+        default:
+            return mix(payload + static_cast<std::uint64_t>(tag));
+    }
+}
 
 static Variant pop(std::vector<Variant>& stack) {
     const auto last = stack.back();
@@ -219,6 +279,166 @@ static Variant pop(std::vector<Variant>& stack) {
     return last;
 }
 
+template<typename FUNCTOR>
+static void binary_operation(std::vector<Variant>& stack, FUNCTOR call) {
+    Variant second {pop(stack)};
+    Variant first {pop(stack)};
+    stack.push_back(call(first, second));
+}
+
+static void pop_values(std::vector<Variant>& stack, const size_t amount) {
+    stack.erase(stack.end() - amount, stack.end());
+}
+
+template<bool CHECKED>
+static void swap_top(std::vector<Variant>& stack, const size_t index) {
+    if constexpr (CHECKED)
+        stack.at(stack.size() - 1).swap(stack.at(stack.size() - 1 - index));
+    else
+        stack[stack.size() - 1].swap(stack[stack.size() - 1 - index]);
+}
+
+template<bool CHECKED>
+static void push_const(std::vector<Variant>& stack, const std::vector<Variant>& constants, const size_t index) {
+    if constexpr (CHECKED)
+        if (index >= constants.size())
+            throw std::out_of_range("Program::push_const: index out of range");
+    stack.push_back(constants[index]);
+}
+
+template<bool CHECKED>
+static void push_stack(std::vector<Variant>& stack, const size_t index) {
+    if constexpr (CHECKED)
+        if (index >= stack.size())
+            throw std::out_of_range("Program::push_global: index out of range");
+    stack.push_back(stack[stack.size() - index - 1]);
+}
+
+static void push_global(std::vector<Variant>& stack) {
+    push_stack<true>(stack, pop(stack).try_to_index().value());
+}
+
+template<bool CHECKED>
+static void delete_value(std::vector<Variant>& stack, const size_t index) {
+    if constexpr (CHECKED)
+        stack.at(stack.size() - index - 1).unchecked_delete();
+    else
+        stack[stack.size() - index - 1].unchecked_delete();
+}
+
+template<bool CHECKED>
+static void call(std::vector<Variant>& stack, const size_t argument_count) {
+    Variant callable {pop(stack)};
+    if constexpr (CHECKED)
+        if (argument_count > stack.size())
+            throw std::out_of_range("Program::curry: argument count out of range");
+    auto result = callable.call({
+        stack.end() - static_cast<std::ptrdiff_t>(argument_count),
+        argument_count
+    });
+    pop_values(stack, argument_count);
+    stack.push_back(result);
+}
+
+template<bool CHECKED>
+static void set(std::vector<Variant>& stack) {
+    const Variant value = pop(stack);
+    const Variant index = pop(stack);
+    if constexpr (CHECKED)
+        if (stack.empty())
+            throw std::out_of_range("Program::set: stack is empty");
+    if (stack.back().set(index, value) == false)
+        throw ProjectError("cannot set index to value");
+}
+
+/// SWAP index followed by POP 1.
+template<bool CHECKED>
+static void assign_from_top(std::vector<Variant>& stack, const size_t index) {
+    if constexpr (CHECKED)
+        if (index >= stack.size())
+            throw std::out_of_range("Program::assign_from_top: index out of range");
+    stack[stack.size() - 1 - index] = std::move(stack.back());
+    stack.pop_back();
+}
+
+/// PUSH_CONST index followed by SET.
+template<bool CHECKED>
+static void set_const(std::vector<Variant>& stack, const std::vector<Variant>& constants, const size_t index) {
+    if constexpr (CHECKED) {
+        if (index >= constants.size())
+            throw std::out_of_range("Program::set_const: index out of range");
+        if (stack.size() < 2)
+            throw std::out_of_range("Program::set: stack is empty");
+    }
+    const Variant key = pop(stack);
+    if (stack.back().set(key, constants[index]) == false)
+        throw ProjectError("cannot set index to value");
+}
+
+static void get(std::vector<Variant>& stack) {
+    const Variant index = pop(stack);
+    const Variant value = pop(stack);
+    const auto result = value.get(index);
+    if (result.has_value() == false)
+        throw ProjectError("cannot get index");
+    stack.push_back(result.value());
+}
+
+template<class ADDRESS>
+static void enter_call(std::vector<ADDRESS>& calls, const ADDRESS return_address) {
+    if (calls.size() >= Program::max_call_depth)
+        throw ProjectError("Program::execute(): call stack overflow");
+    calls.push_back(return_address);
+}
+
+/// Moves the top value amount places down and pops the values above it.
+template<bool CHECKED>
+static void return_value(std::vector<Variant>& stack, const size_t amount) {
+    if constexpr (CHECKED)
+        if (amount >= stack.size())
+            throw std::out_of_range("Program::return_value: stack underflow");
+    if (amount == 0)
+        return;
+    stack[stack.size() - 1 - amount] = std::move(stack.back());
+    pop_values(stack, amount);
+}
+
+static Variant overflow_add(const Variant &a, const Variant &b) { return a.overflow_add(b).value(); }
+static Variant overflow_sub(const Variant &a, const Variant &b) { return a.overflow_sub(b).value(); }
+static Variant overflow_mul(const Variant &a, const Variant &b) { return a.overflow_mul(b).value(); }
+static Variant overflow_div(const Variant &a, const Variant &b) { return a.overflow_div(b).value(); }
+static Variant overflow_mod(const Variant &a, const Variant &b) { return a.overflow_mod(b).value(); }
+static Variant or_else(const Variant &a, const Variant &b) { return a.or_else(b); }
+static Variant and_else(const Variant &a, const Variant &b) { return a.and_else(b); }
+
+std::string_view Program::instruction_name(const InstructionType type) {
+    switch (type) {
+        case OVERFLOW_ADD: return "OVERFLOW_ADD";
+        case OVERFLOW_SUB: return "OVERFLOW_SUB";
+        case OVERFLOW_MUL: return "OVERFLOW_MUL";
+        case OVERFLOW_DIV: return "OVERFLOW_DIV";
+        case OVERFLOW_MOD: return "OVERFLOW_MOD";
+        case OR_ELSE: return "OR_ELSE";
+        case AND_ELSE: return "AND_ELSE";
+        case PUSH_CONST: return "PUSH_CONST";
+        case PUSH_GLOBAL: return "PUSH_GLOBAL";
+        case PUSH_STACK: return "PUSH_STACK";
+        case CALL: return "CALL";
+        case POP: return "POP";
+        case SWAP: return "SWAP";
+        case PUSH_IMMEDIATE: return "PUSH_IMMEDIATE";
+        case DELETE: return "DELETE";
+        case GET: return "GET";
+        case SET: return "SET";
+        case EQUAL: return "EQUAL";
+        case JUMP_IF_POSITIVE: return "JUMP_IF_POSITIVE";
+        case CALL_LOCAL: return "CALL_LOCAL";
+        case RETURN: return "RETURN";
+        case TAIL_CALL_LOCAL: return "TAIL_CALL_LOCAL";
+        default: return "UNKNOWN";
+    }
+}
+
 size_t Program::Instruction::stack_arguments() const {
     switch (type) {
         case PUSH_CONST:
@@ -244,7 +464,11 @@ size_t Program::Instruction::stack_arguments() const {
         case SET:
             return 3;
         case CALL:
+        case RETURN:
             return argument + 1;
+        case CALL_LOCAL:
+        case TAIL_CALL_LOCAL:
+            return call_arguments(argument);
         default:
             throw std::logic_error("Unhandled type");
     }
@@ -263,12 +487,44 @@ int Program::Instruction::stack_increment() const {
     }
 }
 
+Program::Program(std::vector<Instruction> instructions, std::vector<Variant> constants, const Dispatch dispatch)
+    : instructions(std::move(instructions)), constants(std::move(constants)), dispatch(dispatch)
+{
+    if (dispatch == Dispatch::THREADED) {
+        NullTracer tracer;
+        threaded_code = decode_threaded(execute_threaded(nullptr, nullptr, tracer), true, &superinstructions);
+    }
+}
+
 void Program::execute(std::vector<Variant>& stack) const {
-    size_t instruction_index = 0;
-    while (instruction_index < instructions.size()) {
-        std::cerr << '\n';
-        instruction_index = execute_instruction(stack, instruction_index);
+    ExecutionArena::Scope arena;
+    if (native_code != nullptr)
+        native_code->execute(*this, stack);
+    else {
+        NullTracer tracer;
+        if (max_stack_depth.has_value())
+            stack.reserve(stack.size() + max_stack_depth.value());
+        if (dispatch == Dispatch::THREADED)
+            execute_threaded(&stack, threaded_code.data(), tracer);
+        else
+            execute_switch(stack, tracer);
     }
+    arena.copy_out(stack);
+}
+
+void Program::execute(std::vector<Variant>& stack, Tracer& tracer) const {
+    ExecutionArena::Scope arena;
+    if (max_stack_depth.has_value())
+        stack.reserve(stack.size() + max_stack_depth.value());
+    if (dispatch == Dispatch::THREADED) {
+        // Handler addresses belong to one instantiation, so traced runs decode their own copy.
+        // It is not fused, the tracer sees every instruction.
+        auto code = decode_threaded(execute_threaded(nullptr, nullptr, tracer), false);
+        execute_threaded(&stack, code.data(), tracer);
+    }
+    else
+        execute_switch(stack, tracer);
+    arena.copy_out(stack);
 }
 
 std::vector<Variant> Program::execute() const {
@@ -277,107 +533,485 @@ std::vector<Variant> Program::execute() const {
     return stack;
 }
 
-size_t Program::execute_instruction(std::vector<Variant> &stack, const size_t instruction) const {
-    switch (auto [type, argument] = instructions.at(instruction); type) {
-        BINARY_OPERATION(OVERFLOW_ADD, [](const auto &a, const auto &b) { return a.overflow_add(b).value(); });
-        BINARY_OPERATION(OVERFLOW_SUB,  [](const auto &a, const auto &b) { return a.overflow_sub(b).value(); });
-        BINARY_OPERATION(OVERFLOW_MUL, [](const auto &a, const auto &b) { return a.overflow_mul(b).value(); });
-        BINARY_OPERATION(OVERFLOW_DIV, [](const auto &a, const auto &b) { return a.overflow_div(b).value(); });
-        BINARY_OPERATION(OVERFLOW_MOD, [](const auto &a, const auto &b) { return a.overflow_mod(b).value(); });
-        BINARY_OPERATION(OR_ELSE, [](const auto &a, const auto &b) { return a.or_else(b); });
-        BINARY_OPERATION(AND_ELSE, [](const auto &a, const auto &b) { return a.and_else(b); });
-        case POP: {
-            const auto amount = argument;
-            stack.erase(stack.end() - amount, stack.end());
-        } break;
-        case SWAP: {
-            const size_t index = argument;
-            stack.at(stack.size() - 1).swap(stack.at(stack.size() - 1 - index));
-        } break;
-        case PUSH_CONST: {
-            const size_t index = argument;
-            if (index >= constants.size())
-                throw std::out_of_range("Program::push_const: index out of range");
-            stack.push_back(constants.at(index));
-        } break;
-        case PUSH_STACK: {
-            const size_t index = argument;
-            if (index >= stack.size())
-                throw std::out_of_range("Program::push_global: index out of range");
-            stack.push_back(stack.at(stack.size() - index - 1));
-        } break;
-        case PUSH_GLOBAL: {
-            const size_t index = pop(stack).try_to_index().value();
-            if (index >= stack.size())
-                throw std::out_of_range("Program::push_global: index out of range");
-            stack.push_back(stack.at(stack.size() - index - 1));
-        } break;
-        case DELETE: {
-            const size_t index = argument;
-            stack.at(stack.size() - index - 1).unchecked_delete();
-        } break;
-        case PUSH_IMMEDIATE: {
-            stack.push_back(Variant::integer(argument));
-        } break;
-        case CALL: {
-            Variant callable {pop(stack)};
-            auto argument_count = argument;
-            if (argument_count >= constants.size())
-                throw std::out_of_range("Program::curry: argument count out of range");
-            auto result = callable.call({
-                stack.end() - argument_count,
-                argument_count
-            });
-            stack.erase(stack.end() - argument_count, stack.end());
-            stack.push_back(result);
-        } break;
+template<class TRACER>
+void Program::execute_switch(std::vector<Variant>& stack, TRACER& tracer) const {
+    size_t instruction_index = 0;
+    CallStack calls;
+    if (is_verified() == false) {
+        while (instruction_index < instructions.size()) {
+            if constexpr (TRACER::enabled)
+                tracer.record(instruction_index, instructions[instruction_index], stack);
+            instruction_index = execute_instruction<true>(stack, calls, instruction_index);
+        }
+        return;
+    }
+    while (instruction_index < instructions.size()) {
+        if constexpr (TRACER::enabled)
+            tracer.record(instruction_index, instructions[instruction_index], stack);
+        instruction_index = execute_instruction<false>(stack, calls, instruction_index);
+    }
+}
+
+template<bool CHECKED>
+size_t Program::execute_instruction(std::vector<Variant> &stack, CallStack &calls, const size_t instruction) const {
+    switch (auto [type, argument] = CHECKED ? instructions.at(instruction) : instructions[instruction]; type) {
+        case OVERFLOW_ADD: binary_operation(stack, overflow_add); break;
+        case OVERFLOW_SUB: binary_operation(stack, overflow_sub); break;
+        case OVERFLOW_MUL: binary_operation(stack, overflow_mul); break;
+        case OVERFLOW_DIV: binary_operation(stack, overflow_div); break;
+        case OVERFLOW_MOD: binary_operation(stack, overflow_mod); break;
+        case OR_ELSE: binary_operation(stack, or_else); break;
+        case AND_ELSE: binary_operation(stack, and_else); break;
+        case POP: pop_values(stack, argument); break;
+        case SWAP: swap_top<CHECKED>(stack, argument); break;
+        case PUSH_CONST: push_const<CHECKED>(stack, constants, argument); break;
+        case PUSH_STACK: push_stack<CHECKED>(stack, argument); break;
+        case PUSH_GLOBAL: push_global(stack); break;
+        case DELETE: delete_value<CHECKED>(stack, argument); break;
+        case PUSH_IMMEDIATE: stack.push_back(Variant::integer(argument)); break;
+        case CALL: call<CHECKED>(stack, argument); break;
         case JUMP_IF_POSITIVE: {
-            const size_t jump = argument;
-            if (Variant condition {pop(stack)}; condition.jumps_on_jump_if_positive())
-                return jump;
-        } break;
-        case SET: {
-            const Variant value = pop(stack);
-            const Variant index = pop(stack);
-            if (stack.empty())
-                throw std::out_of_range("Program::set: stack is empty");
-            if (stack.back().set(index, value) == false)
-                throw ProjectError("cannot set index to value");
-        } break;
-        case GET: {
-            const Variant index = pop(stack);
-            const Variant value = pop(stack);
-            const auto result = value.get(index);
-            if (result.has_value() == false)
-                throw ProjectError("cannot get index");
-            stack.push_back(result.value());
+            if (pop(stack).jumps_on_jump_if_positive())
+                return argument;
         } break;
+        case SET: set<CHECKED>(stack); break;
+        case GET: get(stack); break;
+        case CALL_LOCAL:
+            enter_call(calls, instruction + 1);
+            return call_target(argument);
+        case RETURN: {
+            return_value<CHECKED>(stack, argument);
+            if (calls.empty())
+                return instructions.size();
+            const size_t next = calls.back();
+            calls.pop_back();
+            return next;
+        }
+        case TAIL_CALL_LOCAL:
+            return call_target(argument);
         default:
             throw std::runtime_error("Program::execute(): Unknown instruction");
     }
     return instruction + 1;
 }
 
+template size_t Program::execute_instruction<true>(std::vector<Variant> &stack, CallStack &calls, size_t instruction) const;
+template size_t Program::execute_instruction<false>(std::vector<Variant> &stack, CallStack &calls, size_t instruction) const;
+
+void Program::verify() {
+    if (is_verified())
+        return;
+    const auto depths = verified_depths();
+    max_stack_depth = *std::max_element(depths.begin(), depths.end());
+    if (dispatch == Dispatch::THREADED) {
+        NullTracer tracer;
+        threaded_code = decode_threaded(execute_threaded(nullptr, nullptr, tracer), true, &superinstructions);
+    }
+}
+
+std::vector<size_t> Program::verified_depths() const {
+    return verification().depths;
+}
+
+std::vector<size_t> Program::verified_functions() const {
+    return verification().functions;
+}
+
+Program::Verification Program::verification() const {
+    const size_t size = instructions.size();
+    std::vector<std::optional<size_t>> depths(size + 1);
+    // Entry of the function reaching every instruction, 0 outside of functions.
+    std::vector<size_t> functions(size + 1);
+    std::vector<size_t> pending = {0};
+    depths[0] = 0;
+    std::vector<bool> jump_targets(size + 1);
+    for (const auto &[type, argument] : instructions) {
+        if (type == JUMP_IF_POSITIVE)
+            jump_targets[std::min<size_t>(argument, size)] = true;
+        if (type == CALL_LOCAL || type == TAIL_CALL_LOCAL)
+            jump_targets[std::min<size_t>(call_target(argument), size)] = true;
+    }
+    const auto reach = [&](const size_t target, const size_t depth, const size_t function, const size_t from) {
+        if (target == size && function != 0)
+            throw VerificationError(from, "function does not return");
+        if (depths[target].has_value() == false) {
+            depths[target] = depth;
+            functions[target] = function;
+            pending.push_back(target);
+        }
+        else if (functions[target] != function)
+            throw VerificationError(from, "instruction " + std::to_string(target) + " is shared between functions");
+        else if (depths[target].value() != depth)
+            throw VerificationError(from, "inconsistent stack depth at instruction " + std::to_string(target));
+    };
+    const auto follow = [&] {
+        while (pending.empty() == false) {
+            const size_t index = pending.back();
+            pending.pop_back();
+            if (index == size)
+                continue;
+            const auto &instruction = instructions[index];
+            const auto [type, argument] = instruction;
+            const size_t depth = depths[index].value();
+            const size_t function = functions[index];
+            if (type > TAIL_CALL_LOCAL)
+                throw VerificationError(index, "unknown instruction");
+            // Execution has no implementation of EQUAL, it would throw when the program runs.
+            if (type == EQUAL)
+                throw VerificationError(index, "EQUAL is not implemented");
+            if (instruction.stack_arguments() > depth)
+                throw VerificationError(index, "stack underflow");
+            switch (type) {
+                case PUSH_STACK:
+                case SWAP:
+                case DELETE:
+                    if (argument >= depth)
+                        throw VerificationError(index, "stack index out of range");
+                    break;
+                case POP:
+                    if (argument > depth)
+                        throw VerificationError(index, "stack underflow");
+                    break;
+                case PUSH_CONST:
+                    if (argument >= constants.size())
+                        throw VerificationError(index, "constant index out of range");
+                    break;
+                case JUMP_IF_POSITIVE:
+                    if (argument > size)
+                        throw VerificationError(index, "jump target out of range");
+                    break;
+                case TAIL_CALL_LOCAL:
+                    if (function == 0)
+                        throw VerificationError(index, "tail call outside of a function");
+                    if (depth != call_arguments(argument))
+                        throw VerificationError(index, "tail call keeps values below its arguments");
+                    [[fallthrough]];
+                case CALL_LOCAL:
+                    if (call_target(argument) == 0 || call_target(argument) >= size)
+                        throw VerificationError(index, "call target out of range");
+                    break;
+                default:
+                    break;
+            }
+            const size_t next_depth = depth - instruction.stack_arguments() + instruction.stack_increment();
+            if (type == RETURN) {
+                if (function == 0)
+                    reach(size, next_depth, function, index);
+                else if (next_depth != 1)
+                    throw VerificationError(index, "function returns with " + std::to_string(next_depth) + " values");
+                continue;
+            }
+            if (type == CALL_LOCAL || type == TAIL_CALL_LOCAL)
+                reach(call_target(argument), call_arguments(argument), call_target(argument), index);
+            if (type == TAIL_CALL_LOCAL)
+                continue;
+            if (type == JUMP_IF_POSITIVE)
+                reach(argument, next_depth, function, index);
+            // Jumps emitted by BytecodeBuilder::unconditional_jump() never fall through.
+            const bool unconditional = type == JUMP_IF_POSITIVE && index > 0 && jump_targets[index] == false
+                && instructions[index - 1].type == PUSH_IMMEDIATE && instructions[index - 1].argument > 0;
+            if (unconditional == false)
+                reach(index + 1, next_depth, function, index);
+        }
+    };
+    follow();
+    // Dead code after an unconditional jump keeps the depth it would fall through with, so the
+    // users of the depths can still translate it.
+    for (size_t index = 1; index <= size; ++index) {
+        if (depths[index].has_value() || depths[index - 1].has_value() == false
+            || instructions[index - 1].type != JUMP_IF_POSITIVE)
+            continue;
+        reach(index, depths[index - 1].value() - 1, functions[index - 1], index - 1);
+        follow();
+    }
+    Verification result;
+    result.depths.reserve(depths.size());
+    for (size_t index = 0; index < depths.size(); ++index) {
+        if (depths[index].has_value() == false)
+            throw VerificationError(index, "unreachable instruction");
+        result.depths.push_back(depths[index].value());
+    }
+    result.functions = std::move(functions);
+    return result;
+}
+
+bool Program::compile_native() {
+    if (is_native())
+        return true;
+    verify();
+    const auto verified = verification();
+    native_code = NativeCode::compile(*this, verified.depths, verified.functions);
+    return is_native();
+}
+
+std::vector<Program::ThreadedInstruction> Program::decode_threaded(const void* const* handlers, const bool fuse,
+    size_t* fused) const {
+    if (is_verified())
+        handlers += threaded_handler_count;
+    const auto size = static_cast<word>(instructions.size());
+    std::vector<bool> jump_targets(size + 1);
+    for (const auto &[type, argument] : instructions) {
+        if (type == JUMP_IF_POSITIVE)
+            jump_targets[std::min(argument, size)] = true;
+        if (type == CALL_LOCAL || type == TAIL_CALL_LOCAL)
+            jump_targets[std::min(call_target(argument), size)] = true;
+    }
+    // Matches a superinstruction starting at index, its length is zero when there is none.
+    const auto superinstruction = [&](const size_t index) -> std::pair<size_t, ThreadedInstruction> {
+        const auto fits = [&](const size_t length) {
+            if (index + length > size)
+                return false;
+            for (size_t i = index + 1; i < index + length; ++i)
+                if (jump_targets[i])
+                    return false;
+            return true;
+        };
+        const auto type = [&](const size_t offset) { return instructions[index + offset].type; };
+        const auto argument = [&](const size_t offset) { return instructions[index + offset].argument; };
+        if (fits(3) && type(0) == PUSH_STACK && type(1) == PUSH_IMMEDIATE) {
+            if (type(2) == OVERFLOW_ADD)
+                return {3, {handlers[FUSED_PUSH_STACK_ADD_IMMEDIATE], argument(0), argument(1)}};
+            if (type(2) == OVERFLOW_SUB)
+                return {3, {handlers[FUSED_PUSH_STACK_SUB_IMMEDIATE], argument(0), argument(1)}};
+        }
+        if (fits(2) && type(0) == SWAP && type(1) == POP && argument(1) == 1)
+            return {2, {handlers[FUSED_ASSIGN_FROM_TOP], argument(0), 0}};
+        if (fits(2) && type(0) == PUSH_CONST && type(1) == SET)
+            return {2, {handlers[FUSED_SET_CONST], argument(0), 0}};
+        if (fits(2) && type(0) == PUSH_IMMEDIATE && argument(0) > 0 && type(1) == JUMP_IF_POSITIVE)
+            return {2, {handlers[FUSED_JUMP], std::min(argument(1), size), argument(0)}};
+        return {0, {}};
+    };
+
+    std::vector<ThreadedInstruction> code;
+    code.reserve(instructions.size() + 1);
+    // Jumps still refer to instruction indices until every instruction has its position in code.
+    std::vector<word> positions(size + 1);
+    std::vector<size_t> jumps;
+    size_t fused_count = 0;
+    for (size_t index = 0; index < size;) {
+        positions[index] = static_cast<word>(code.size());
+        if (fuse) {
+            if (const auto [length, fused_instruction] = superinstruction(index); length > 0) {
+                if (fused_instruction.handler == handlers[FUSED_JUMP])
+                    jumps.push_back(code.size());
+                code.push_back(fused_instruction);
+                index += length;
+                fused_count++;
+                continue;
+            }
+        }
+        const auto [type, argument] = instructions[index];
+        const size_t handler = type <= TAIL_CALL_LOCAL ? static_cast<size_t>(type) : THREADED_UNKNOWN;
+        if (type == JUMP_IF_POSITIVE) {
+            jumps.push_back(code.size());
+            code.push_back({handlers[handler], std::min(argument, size), 0});
+        }
+        else if (type == CALL_LOCAL || type == TAIL_CALL_LOCAL) {
+            jumps.push_back(code.size());
+            code.push_back({handlers[handler], std::min(call_target(argument), size), call_arguments(argument)});
+        }
+        else
+            code.push_back({handlers[handler], argument, 0});
+        index++;
+    }
+    positions[size] = static_cast<word>(code.size());
+    code.push_back({handlers[THREADED_HALT], 0, 0});
+    for (const size_t jump : jumps)
+        code[jump].argument = positions[code[jump].argument];
+    if (fused != nullptr)
+        *fused = fused_count;
+    return code;
+}
+
+template<class TRACER>
+const void* const* Program::execute_threaded(std::vector<Variant>* stack_pointer, ThreadedInstruction* code,
+    TRACER& tracer) const {
+#if PROJECT_COMPUTED_GOTO
+    // Indexed by InstructionType, followed by the ThreadedHandler entries.
+    // The second table is used for verified programs and skips the range checks.
+    static const void* const handlers[2][threaded_handler_count] = {{
+        &&overflow_add, &&overflow_sub, &&overflow_mul, &&overflow_div, &&overflow_mod,
+        &&or_else, &&and_else,
+        &&push_const, &&push_global, &&push_stack,
+        &&call, &&pop, &&swap,
+        &&push_immediate, &&delete_value,
+        &&get, &&set, &&unknown,
+        &&jump_if_positive, &&call_local, &&return_from_call, &&jump,
+        &&halt, &&unknown,
+        &&push_stack_add_immediate, &&push_stack_sub_immediate,
+        &&assign_from_top, &&set_const, &&jump,
+    }, {
+        &&overflow_add, &&overflow_sub, &&overflow_mul, &&overflow_div, &&overflow_mod,
+        &&or_else, &&and_else,
+        &&push_const_unchecked, &&push_global, &&push_stack_unchecked,
+        &&call_unchecked, &&pop, &&swap_unchecked,
+        &&push_immediate, &&delete_value_unchecked,
+        &&get, &&set_unchecked, &&unknown,
+        &&jump_if_positive, &&call_local, &&return_from_call_unchecked, &&jump,
+        &&halt, &&unknown,
+        &&push_stack_add_immediate_unchecked, &&push_stack_sub_immediate_unchecked,
+        &&assign_from_top_unchecked, &&set_const_unchecked, &&jump,
+    }};
+    static_assert(std::size(handlers[0]) == THREADED_HANDLER_COUNT);
+    if (stack_pointer == nullptr)
+        return handlers[0];
+
+    auto &stack = *stack_pointer;
+    ThreadedInstruction *ip = code;
+    std::vector<ThreadedInstruction*> calls;
+
+#define DISPATCH() do { \
+        if constexpr (TRACER::enabled) \
+            if (ip->handler != handlers[0][THREADED_HALT]) \
+                tracer.record(ip - code, instructions[ip - code], stack); \
+        goto *std::atomic_ref(ip->handler).load(std::memory_order_relaxed); \
+    } while (false)
+#define NEXT() do { ++ip; DISPATCH(); } while (false)
+// Rewrites the current instruction, other executions of the program may run it concurrently.
+#define QUICKEN(target) std::atomic_ref(ip->handler).store(&&target, std::memory_order_relaxed)
+// Arithmetic is specialised after its first execution for two integers of the same signedness
+// or two doubles. A failed guard falls back to the generic handler for good.
+#define QUICKENED_ARITHMETIC(name, OPERATOR) \
+name: { \
+    const auto &first = stack[stack.size() - 2]; \
+    const auto &second = stack.back(); \
+    if (first.tag == second.tag && (first.tag == Variant::Type::SIGNED || first.tag == Variant::Type::UNSIGNED)) { \
+        QUICKEN(name##_integer); \
+        goto name##_integer; \
+    } \
+    if (first.tag == Variant::Type::FLOATING_POINT && second.tag == Variant::Type::FLOATING_POINT) { \
+        QUICKEN(name##_floating_point); \
+        goto name##_floating_point; \
+    } \
+    QUICKEN(name##_generic); \
+} \
+name##_generic: binary_operation(stack, ::name); NEXT(); \
+name##_integer: { \
+    auto &first = stack[stack.size() - 2]; \
+    const auto &second = stack.back(); \
+    if (first.tag != second.tag || (first.tag != Variant::Type::SIGNED && first.tag != Variant::Type::UNSIGNED)) { \
+        QUICKEN(name##_generic); \
+        goto name##_generic; \
+    } \
+    first.payload = first.payload OPERATOR second.payload; \
+    stack.pop_back(); \
+} NEXT(); \
+name##_floating_point: { \
+    auto &first = stack[stack.size() - 2]; \
+    const auto &second = stack.back(); \
+    if (first.tag != Variant::Type::FLOATING_POINT || second.tag != Variant::Type::FLOATING_POINT) { \
+        QUICKEN(name##_generic); \
+        goto name##_generic; \
+    } \
+    first.payload = std::bit_cast<std::uint64_t>( \
+        std::bit_cast<double>(first.payload) OPERATOR std::bit_cast<double>(second.payload)); \
+    stack.pop_back(); \
+} NEXT()
+// Pushes a copy of a stack value combined with an immediate, unsigned values skip the generic operation.
+#define FUSED_PUSH_STACK_IMMEDIATE(name, CHECKED, OPERATOR, generic) \
+name: { \
+    if constexpr (CHECKED) \
+        if (ip->argument >= stack.size()) \
+            throw std::out_of_range("Program::push_stack: index out of range"); \
+    const auto &value = stack[stack.size() - ip->argument - 1]; \
+    if (value.tag == Variant::Type::UNSIGNED) \
+        stack.push_back(Variant::integer(value.payload OPERATOR ip->operand)); \
+    else \
+        stack.push_back(generic(value, Variant::integer(ip->operand))); \
+} NEXT()
+
+    DISPATCH();
+QUICKENED_ARITHMETIC(overflow_add, +);
+QUICKENED_ARITHMETIC(overflow_sub, -);
+QUICKENED_ARITHMETIC(overflow_mul, *);
+overflow_div: binary_operation(stack, ::overflow_div); NEXT();
+overflow_mod: binary_operation(stack, ::overflow_mod); NEXT();
+or_else: binary_operation(stack, ::or_else); NEXT();
+and_else: binary_operation(stack, ::and_else); NEXT();
+pop: pop_values(stack, ip->argument); NEXT();
+swap: swap_top<true>(stack, ip->argument); NEXT();
+swap_unchecked: swap_top<false>(stack, ip->argument); NEXT();
+push_const: ::push_const<true>(stack, constants, ip->argument); NEXT();
+push_const_unchecked: ::push_const<false>(stack, constants, ip->argument); NEXT();
+push_stack: ::push_stack<true>(stack, ip->argument); NEXT();
+push_stack_unchecked: ::push_stack<false>(stack, ip->argument); NEXT();
+push_global: ::push_global(stack); NEXT();
+delete_value: ::delete_value<true>(stack, ip->argument); NEXT();
+delete_value_unchecked: ::delete_value<false>(stack, ip->argument); NEXT();
+push_immediate: stack.push_back(Variant::integer(ip->argument)); NEXT();
+call: ::call<true>(stack, ip->argument); NEXT();
+call_unchecked: ::call<false>(stack, ip->argument); NEXT();
+set: ::set<true>(stack); NEXT();
+set_unchecked: ::set<false>(stack); NEXT();
+get: ::get(stack); NEXT();
+jump_if_positive:
+    if (pop(stack).jumps_on_jump_if_positive()) {
+        ip = code + ip->argument;
+        DISPATCH();
+    }
+    NEXT();
+FUSED_PUSH_STACK_IMMEDIATE(push_stack_add_immediate, true, +, ::overflow_add);
+FUSED_PUSH_STACK_IMMEDIATE(push_stack_add_immediate_unchecked, false, +, ::overflow_add);
+FUSED_PUSH_STACK_IMMEDIATE(push_stack_sub_immediate, true, -, ::overflow_sub);
+FUSED_PUSH_STACK_IMMEDIATE(push_stack_sub_immediate_unchecked, false, -, ::overflow_sub);
+assign_from_top: ::assign_from_top<true>(stack, ip->argument); NEXT();
+assign_from_top_unchecked: ::assign_from_top<false>(stack, ip->argument); NEXT();
+set_const: ::set_const<true>(stack, constants, ip->argument); NEXT();
+set_const_unchecked: ::set_const<false>(stack, constants, ip->argument); NEXT();
+jump:
+    ip = code + ip->argument;
+    DISPATCH();
+call_local:
+    enter_call(calls, ip + 1);
+    ip = code + ip->argument;
+    DISPATCH();
+return_from_call:
+    ::return_value<true>(stack, ip->argument);
+    goto return_to_caller;
+return_from_call_unchecked:
+    ::return_value<false>(stack, ip->argument);
+return_to_caller:
+    if (calls.empty())
+        goto halt;
+    ip = calls.back();
+    calls.pop_back();
+    DISPATCH();
+unknown:
+    throw std::runtime_error("Program::execute(): Unknown instruction");
+halt:
+    return nullptr;
+
+#undef FUSED_PUSH_STACK_IMMEDIATE
+#undef QUICKENED_ARITHMETIC
+#undef QUICKEN
+#undef NEXT
+#undef DISPATCH
+#else
+    throw std::logic_error("Program::execute(): threaded dispatch is not supported by this compiler");
+#endif
+}
+
 
 std::ostream & project::operator<<(std::ostream &stream, const Variant &variant) {
-    std::visit([&]<class T>(const T &self) {
+    variant.visit([&]<class T>(const T &self) {
         if constexpr (std::is_same_v<T, Variant::map>) {
             stream << '{';
             bool first = true;
-            for (const auto &pair : self) {
+            for (const auto &[key, value] : self) {
                 if (first) {
-                    stream << pair.first << ": " << pair.second;
+                    stream << key << ": " << value;
                     first = false;
                 }
                 else
-                    stream << ", " << pair.first << ": " << pair.second;
+                    stream << ", " << key << ": " << value;
             }
             stream << '}';
-        } else if constexpr (std::is_same_v<T, Variant::function>) {
+        } else if constexpr (std::is_same_v<T, Variant::native_function>) {
             stream << "<function>";
         } else {
             stream << self;
         }
-    }, variant.data);
+    });
     return stream;
 }
@@ -2,9 +2,18 @@
 
 #include "core.h"
 
-namespace project {
+#include <string_view>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PROJECT_COMPUTED_GOTO 1
+#else
+#define PROJECT_COMPUTED_GOTO 0
+#endif
 
+namespace project {
 
+    struct Tracer;
+    class NativeCode;
 
     /*struct GlobalReference {
         Variant *reference;
@@ -44,6 +53,16 @@ namespace project {
             SET,
             EQUAL,
             JUMP_IF_POSITIVE,
+            /// Calls the function at call_target(argument), its call_arguments(argument) topmost
+            /// values become the bottom of the callee's frame.
+            CALL_LOCAL,
+            /// Pops the result and argument more values, pushes the result back and continues
+            /// after the CALL_LOCAL that entered the function. Ends the program outside of one.
+            RETURN,
+            /// Continues in the function at call_target(argument) with the frame of the running
+            /// function, which holds only the call_arguments(argument) values passed to it. The
+            /// callee returns to the caller of the running function.
+            TAIL_CALL_LOCAL,
         };
 
         constexpr static char instr_repr[] = {
@@ -55,6 +74,22 @@ namespace project {
             '~'
         };
 
+        /// CALL_LOCAL and TAIL_CALL_LOCAL keep the argument count in the low bits of their argument.
+        static constexpr word call_argument_bits = 8;
+        static constexpr word max_call_arguments = (word{1} << call_argument_bits) - 1;
+        static constexpr word max_call_target = max_word_limit >> call_argument_bits;
+        /// Nested CALL_LOCAL frames a run may hold before it throws ProjectError.
+        static constexpr size_t max_call_depth = size_t{1} << 20;
+
+        static constexpr word local_call(const word target, const word arguments) {
+            return static_cast<word>(target << call_argument_bits | arguments);
+        }
+        static constexpr word call_target(const word argument) { return argument >> call_argument_bits; }
+        static constexpr word call_arguments(const word argument) { return argument & max_call_arguments; }
+
+        /// Mnemonic of an instruction type, "UNKNOWN" for values outside the enumeration.
+        static std::string_view instruction_name(InstructionType type);
+
         struct Instruction {
             InstructionType type;
             word argument;
@@ -63,22 +98,118 @@ namespace project {
             [[nodiscard]] int stack_increment() const;
         };
 
-        Program() = default;
-        Program(std::vector<Instruction> instructions, std::vector<Variant> constants)
-            : instructions(std::move(instructions)), constants(std::move(constants)) {}
+        /// Execution engine used by execute(). SWITCH runs execute_instruction() once per
+        /// instruction, THREADED jumps directly between handlers of a pre-decoded copy
+        /// of the instructions (computed goto, available only on GCC and Clang).
+        enum class Dispatch : std::uint8_t {
+            SWITCH,
+            THREADED,
+        };
+
+        static constexpr Dispatch default_dispatch = PROJECT_COMPUTED_GOTO ? Dispatch::THREADED : Dispatch::SWITCH;
+
+        Program() : Program({}, {}) {}
+        Program(std::vector<Instruction> instructions, std::vector<Variant> constants,
+            Dispatch dispatch = default_dispatch);
         Program(const Program&) = default;
         Program(Program&&) = default;
 
+        /// Proves that every instruction is reachable, or dead code following an unconditional
+        /// jump, is implemented and keeps the stack within bounds, that all constant and jump indices are valid
+        /// and that all paths agree on the stack depth.
+        /// Each CALL_LOCAL target starts a function whose frame holds only its arguments, its
+        /// instructions are not shared with other functions and it leaves exactly the result.
+        /// TAIL_CALL_LOCAL is only valid in a function whose frame holds just the arguments.
+        /// A JUMP_IF_POSITIVE reached only from a positive PUSH_IMMEDIATE is unconditional, the
+        /// dead code following it gets the depth it would fall through with.
+        /// Throws VerificationError, otherwise later executions reserve the stack once and
+        /// skip the per-instruction range checks.
+        void verify();
+        [[nodiscard]] bool is_verified() const { return max_stack_depth.has_value(); }
+        /// Greatest number of values a verified program keeps on the stack above its entry depth.
+        [[nodiscard]] std::optional<size_t> verified_stack_depth() const { return max_stack_depth; }
+        /// Stack depth of every instruction and of the end of the program, relative to the
+        /// depth at entry, or to the frame of the function holding the instruction.
+        /// Throws VerificationError, see verify().
+        [[nodiscard]] std::vector<size_t> verified_depths() const;
+        /// Entry of the function holding every instruction and the end of the program, 0 for
+        /// the instructions outside of functions. Throws VerificationError, see verify().
+        [[nodiscard]] std::vector<size_t> verified_functions() const;
+        /// Verifies the program and translates it to x86-64 machine code used by later executions.
+        /// Returns false and keeps interpreting when the platform has no native code or
+        /// the program uses an instruction without a translation.
+        bool compile_native();
+        [[nodiscard]] bool is_native() const { return native_code != nullptr; }
+        /// Number of instruction sequences fused into a single threaded handler.
+        [[nodiscard]] size_t superinstruction_count() const { return superinstructions; }
+
         void execute(std::vector<Variant>& stack) const;
+        void execute(std::vector<Variant>& stack, Tracer& tracer) const;
         [[nodiscard]] std::vector<Variant> execute() const;
         [[nodiscard]] Variant run() const { return execute().at(0); }
         Variant operator()() const { return run(); }
 
         const std::vector<Instruction> instructions;
         const std::vector<Variant> constants;
+        const Dispatch dispatch;
 
     protected:
-        size_t execute_instruction(std::vector<Variant>& stack, size_t index) const;
+        /// Return addresses of the CALL_LOCAL frames of one run, innermost last.
+        using CallStack = std::vector<size_t>;
+
+        template<bool CHECKED = true>
+        size_t execute_instruction(std::vector<Variant>& stack, CallStack& calls, size_t index) const;
+
+    private:
+        struct ThreadedInstruction {
+            const void* handler;
+            word argument;
+            /// Second argument of superinstructions, the argument count of CALL_LOCAL.
+            word operand;
+        };
+
+        /// Threaded handlers following the ones indexed by InstructionType.
+        enum ThreadedHandler : size_t {
+            THREADED_HALT = TAIL_CALL_LOCAL + 1,
+            THREADED_UNKNOWN,
+            /// PUSH_STACK argument, PUSH_IMMEDIATE operand, OVERFLOW_ADD
+            FUSED_PUSH_STACK_ADD_IMMEDIATE,
+            /// PUSH_STACK argument, PUSH_IMMEDIATE operand, OVERFLOW_SUB
+            FUSED_PUSH_STACK_SUB_IMMEDIATE,
+            /// SWAP argument, POP 1
+            FUSED_ASSIGN_FROM_TOP,
+            /// PUSH_CONST argument, SET
+            FUSED_SET_CONST,
+            /// PUSH_IMMEDIATE operand > 0, JUMP_IF_POSITIVE argument
+            FUSED_JUMP,
+            THREADED_HANDLER_COUNT,
+        };
+
+        static constexpr size_t threaded_handler_count = THREADED_HANDLER_COUNT;
+
+        struct Verification {
+            std::vector<size_t> depths;
+            std::vector<size_t> functions;
+        };
+
+        std::optional<size_t> max_stack_depth;
+        size_t superinstructions = 0;
+        std::shared_ptr<const NativeCode> native_code;
+        /// Pre-decoded instructions for Dispatch::THREADED, terminated by a halt handler.
+        /// Arithmetic handlers are rewritten in place once their operand types are seen.
+        mutable std::vector<ThreadedInstruction> threaded_code;
+
+        [[nodiscard]] Verification verification() const;
+        template<class TRACER>
+        void execute_switch(std::vector<Variant>& stack, TRACER& tracer) const;
+        /// Runs code on stack, or returns the handler table of this instantiation when stack is nullptr.
+        template<class TRACER>
+        const void* const* execute_threaded(std::vector<Variant>* stack, ThreadedInstruction* code,
+            TRACER& tracer) const;
+        /// Decodes instructions for the handler table, fusing superinstructions when fuse is set.
+        /// Sequences are only fused when no jump lands inside them, jump targets are remapped.
+        [[nodiscard]] std::vector<ThreadedInstruction> decode_threaded(const void* const* handlers,
+            bool fuse = true, size_t* fused = nullptr) const;
     };
 
 } // project
@@ -1,5 +1,7 @@
 #include "ProgramBuilder.h"
 
+#include <algorithm>
+#include <cassert>
 #include <functional>
 #include <istream>
 #include <bits/ranges_algo.h>
@@ -20,6 +22,283 @@ bool ProgramBuilder::is_keyword(const std::string &value) const {
 
 
 
+ProgramBuilder::PendingUses::PendingUses(ProgramBuilder &builder, const std::vector<Symbol*> &symbols)
+    : builder(builder), start(builder.pending.size()) {
+    builder.pending.insert(builder.pending.end(), symbols.rbegin(), symbols.rend());
+}
+
+void ProgramBuilder::PendingUses::next() {
+    assert(builder.pending.size() > start);
+    builder.pending.pop_back();
+}
+
+void ProgramBuilder::define_variable(Symbol &variable) {
+    defining.push_back(&variable);
+    variable.define(*this);
+    defining.pop_back();
+    if (variable.is_declared() == false)
+        return;
+    releasable.push_back(&variable);
+    release_dead_values();
+    if (std::ranges::find(releasable, &variable) == releasable.end() || variable.get_reference() != stack_top())
+        return;
+    // A live value computed on top is moved to the nearest free slot.
+    const auto slot = std::ranges::max_element(free_slots);
+    if (slot == free_slots.end() || *slot >= stack_top().offset || stack_top().offset - *slot >= Program::max_word_limit)
+        return;
+    const StackAddress address(*slot);
+    free_slots.erase(slot);
+    assign_from_top(address);
+    variable.move_reference(address);
+}
+
+void ProgramBuilder::release_variables(const std::vector<Symbol*> &variables, const StackAddress frame_start) {
+    std::erase_if(releasable, [&](Symbol *symbol) {
+        if (std::ranges::find(variables, symbol) == variables.end())
+            return false;
+        if (const auto slot = symbol->get_reference().offset; slot < frame_start.offset) {
+            if (symbol->is_trivially_destructible() == false)
+                symbol->destroy(*this);
+            free_slots.push_back(slot);
+        }
+        return true;
+    });
+    std::erase_if(free_slots, [&](const size_t slot) { return slot >= frame_start.offset; });
+}
+
+void ProgramBuilder::release_dead_values() {
+    if (releasable.empty())
+        return;
+    std::unordered_set<const Symbol*> read;
+    std::vector<const Symbol*> unvisited(pending.begin(), pending.end());
+    while (unvisited.empty() == false) {
+        const auto symbol = unvisited.back();
+        unvisited.pop_back();
+        // Known values are pushed as constants.
+        if (symbol->is_known() && symbol->is_declared() == false)
+            continue;
+        // A declared symbol is pushed from its slot, what it was computed from is not read again.
+        if (read.insert(symbol).second == false || symbol->is_declared()
+            || std::ranges::find(defining, symbol) != defining.end())
+            continue;
+        for (const auto operand : symbol->operands())
+            unvisited.push_back(operand);
+    }
+    std::erase_if(releasable, [&](Symbol *symbol) {
+        if (read.contains(symbol))
+            return false;
+        if (symbol->is_trivially_destructible() == false)
+            symbol->destroy(*this);
+        free_slots.push_back(symbol->get_reference().offset);
+        return true;
+    });
+}
+
+size_t ProgramBuilder::OperationHash::operator()(const Operation &operation) const {
+    auto result = operation.index.hash();
+    for (const auto value : {
+        static_cast<size_t>(operation.type),
+        std::hash<const Symbol*>{}(operation.first),
+        std::hash<const Symbol*>{}(operation.second),
+    })
+        result = result * 31 + value;
+    return result;
+}
+
+const Symbol * ProgramBuilder::operation_operand(const Symbol &operand) {
+    const auto literal = dynamic_cast<const Literal *>(&operand);
+    if (literal == nullptr)
+        return &operand;
+    const auto hash = (*literal)->hash();
+    for (auto [candidate, end] = literal_operands.equal_range(hash); candidate != end; ++candidate)
+        if ((**static_cast<const Literal *>(candidate->second)).is_identical(**literal))
+            return candidate->second;
+    literal_operands.emplace(hash, literal);
+    return literal;
+}
+
+Symbol & ProgramBuilder::shared_operation(Symbol &symbol) {
+    Operation operation;
+    if (const auto binary = dynamic_cast<BinaryOperationResult *>(&symbol))
+        operation = {
+            static_cast<Program::InstructionType>(binary->type),
+            operation_operand(binary->left_operand), operation_operand(binary->right_operand), Variant()
+        };
+    else if (const auto get = dynamic_cast<GetSymbol *>(&symbol))
+        operation = {Program::GET, operation_operand(get->value), nullptr, get->index};
+    else
+        return symbol;
+    return *operations.try_emplace(std::move(operation), &symbol).first->second;
+}
+
+bool ProgramBuilder::has_effects(const Symbol &symbol, const std::vector<Symbol *> &computed_elsewhere) const {
+    // Calls of values which are not pure host functions have effects, so do inlined bodies
+    // which may call an impure host function they can reach.
+    bool inlined_call = false;
+    bool impure_function = false;
+    std::unordered_set<const Symbol*> visited;
+    std::vector unvisited{&symbol};
+    while (unvisited.empty() == false) {
+        const auto current = unvisited.back();
+        unvisited.pop_back();
+        if (visited.insert(current).second == false)
+            continue;
+        if (current != &symbol && (current->is_declared() || std::ranges::find(computed_elsewhere, current) != computed_elsewhere.end()))
+            continue;
+        if (const auto call = dynamic_cast<const CurryResult *>(current)) {
+            const auto literal = dynamic_cast<const Literal *>(&call->function);
+            if (literal == nullptr || literal->is_pure() == false)
+                return true;
+        }
+        else if (dynamic_cast<const FunctionResult *>(current) != nullptr)
+            inlined_call = true;
+        else if (const auto literal = dynamic_cast<const Literal *>(current))
+            impure_function |= (*literal)->type() == Variant::Type::FUNCTION && literal->is_pure() == false;
+        if (inlined_call && impure_function)
+            return true;
+        for (const auto operand : current->operands())
+            unvisited.push_back(operand);
+    }
+    return false;
+}
+
+std::vector<Symbol *> ProgramBuilder::scope_variables(const std::vector<Symbol *> &variables, Symbol &expression) const {
+    // Values with a slot or known ones are pushed, functions are not values. A parameter
+    // without a slot is a captured value the body does not read, see InlineFunction::out_of_line().
+    const auto computed = [](const Symbol *symbol) {
+        return symbol->is_declared() == false && symbol->is_known() == false
+            && dynamic_cast<const FunctionSymbol *>(symbol) == nullptr
+            && dynamic_cast<const ParameterSymbol *>(symbol) == nullptr;
+    };
+    // Operands the code of the scope computes whenever it runs. Branches run conditionally and
+    // nested scopes share their values themselves.
+    const auto unconditional = [](const Symbol *symbol) {
+        if (const auto conditional = dynamic_cast<const ConditionalResult *>(symbol))
+            return std::vector{&conditional->condition};
+        if (dynamic_cast<const ScopeSymbol *>(symbol) != nullptr)
+            return std::vector<Symbol*>{};
+        return symbol->operands();
+    };
+    // Variables computed for their effects are read by the scope itself.
+    std::vector<Symbol*> roots;
+    std::ranges::copy_if(variables, std::back_inserter(roots), [&](const Symbol *variable) {
+        return computed(variable) && has_effects(*variable, variables);
+    });
+    roots.push_back(&expression);
+
+    // Symbols the code of the scope reads whenever it runs, nested scopes read them too.
+    // Variables of a nested scope are read through its expression unless they have effects.
+    std::unordered_set<const Symbol*> live;
+    std::vector unread(roots.rbegin(), roots.rend());
+    while (unread.empty() == false) {
+        const auto symbol = unread.back();
+        unread.pop_back();
+        if (live.insert(symbol).second == false)
+            continue;
+        if (const auto conditional = dynamic_cast<const ConditionalResult *>(symbol))
+            unread.push_back(&conditional->condition);
+        else if (dynamic_cast<const ScopeSymbol *>(symbol) != nullptr) {
+            auto operands = symbol->operands();
+            unread.push_back(operands.back());
+            operands.pop_back();
+            std::ranges::copy_if(operands, std::back_inserter(unread), [&](const Symbol *variable) {
+                return computed(variable) && has_effects(*variable, variables);
+            });
+        }
+        else
+            std::ranges::copy(symbol->operands(), std::back_inserter(unread));
+    }
+
+    std::unordered_map<const Symbol*, size_t> reads;
+    std::vector<Symbol*> branches;
+    std::vector unvisited(roots.rbegin(), roots.rend());
+    while (unvisited.empty() == false) {
+        const auto symbol = unvisited.back();
+        unvisited.pop_back();
+        if (computed(symbol) == false || reads[symbol]++ > 0)
+            continue;
+        if (const auto conditional = dynamic_cast<ConditionalResult *>(symbol)) {
+            branches.push_back(&conditional->then_do);
+            branches.push_back(&conditional->else_do);
+        }
+        else if (dynamic_cast<ScopeSymbol *>(symbol) != nullptr)
+            std::ranges::copy(symbol->operands(), std::back_inserter(branches));
+        for (const auto operand : unconditional(symbol))
+            unvisited.push_back(operand);
+    }
+    // A value the scope computes anyway is shared with the branches and scopes reading it too.
+    std::unordered_set<const Symbol*> read_in_branch;
+    while (branches.empty() == false) {
+        const auto symbol = branches.back();
+        branches.pop_back();
+        if (computed(symbol) == false || read_in_branch.insert(symbol).second == false)
+            continue;
+        for (const auto operand : symbol->operands())
+            branches.push_back(operand);
+    }
+    const auto shared = [&](const Symbol *symbol) {
+        const auto found = reads.find(symbol);
+        return found != reads.end() && (found->second > 1 || read_in_branch.contains(symbol));
+    };
+
+    // Depth first, every value follows the ones it is computed from.
+    std::vector<Symbol*> result;
+    std::unordered_set<const Symbol*> visited;
+    const std::function<void(Symbol*)> order = [&](Symbol *symbol) {
+        if (computed(symbol) == false || visited.insert(symbol).second == false)
+            return;
+        for (const auto operand : unconditional(symbol))
+            order(operand);
+        if (symbol != &expression && (shared(symbol) || std::ranges::find(variables, symbol) != variables.end()))
+            result.push_back(symbol);
+    };
+    for (const auto variable : variables) {
+        if (live.contains(variable) == false)
+            continue;
+        order(variable);
+        // Variables which are not computed, such as literals, keep their place.
+        if (std::ranges::find(result, variable) == result.end())
+            result.push_back(variable);
+    }
+    order(&expression);
+    return result;
+}
+
+Symbol & ProgramBuilder::share_values(Symbol &expression) {
+    if (scope_variables({}, expression).empty())
+        return expression;
+    return new_symbol<ScopeSymbol>(expression);
+}
+
+ProgramBuilder::FunctionBody ProgramBuilder::begin_function(const size_t frame_size) {
+    return {
+        BytecodeBuilder::begin_function(frame_size),
+        std::exchange(pending, {}),
+        std::exchange(releasable, {}),
+        std::exchange(free_slots, {}),
+        std::exchange(defining, {}),
+        std::exchange(tail, nullptr),
+    };
+}
+
+FunctionAddress ProgramBuilder::end_function(FunctionBody body) {
+    pending = std::move(body.pending);
+    releasable = std::move(body.releasable);
+    free_slots = std::move(body.free_slots);
+    defining = std::move(body.defining);
+    tail = body.tail;
+    return BytecodeBuilder::end_function(std::move(body.code));
+}
+
+void ProgramBuilder::discard_function(FunctionBody body) {
+    pending = std::move(body.pending);
+    releasable = std::move(body.releasable);
+    free_slots = std::move(body.free_slots);
+    defining = std::move(body.defining);
+    tail = body.tail;
+    BytecodeBuilder::discard_function(std::move(body.code));
+}
+
 Symbol& ProgramBuilder::compile(const ASTExpression &expression, Context &parent) {
     auto& result = expression.create_symbols(*this, parent);
     result.declare(*this);
@@ -381,6 +660,15 @@ std::unique_ptr<ASTExpression> ProgramBuilder::compile_let_expression(std::istre
     }
     std::string variable_name;
     stream >> variable_name;
+    // "rec" is the name of the variable unless another name follows it.
+    bool recursive = false;
+    if (variable_name == "rec") {
+        stream >> std::ws;
+        if (stream.peek() != '=' && stream.peek() != ':') {
+            recursive = true;
+            stream >> variable_name;
+        }
+    }
     char sign;
     stream >> sign;
     std::vector<std::string> parameters;
@@ -398,6 +686,8 @@ std::unique_ptr<ASTExpression> ProgramBuilder::compile_let_expression(std::istre
     }
     if (sign != '=')
         throw MissingToken("=", "let ...");
+    if (recursive && parameters.empty())
+        throw MissingToken(":", "let rec ...");
     auto assign = compile_expression(stream);
     if (assign == nullptr)
         throw MissingExpression("let ... =");
@@ -416,6 +706,7 @@ std::unique_ptr<ASTExpression> ProgramBuilder::compile_let_expression(std::istre
     return std::make_unique<ASTLetExpression>(
         std::move(variable_name),
      std::make_unique<ASTFunction>(std::move(assign), std::move(parameters)),
-        std::move(then_do)
+        std::move(then_do),
+        recursive
     );
 }
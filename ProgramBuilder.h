@@ -7,8 +7,70 @@ namespace project {
 
     class ProgramBuilder : public BytecodeBuilder {
         std::vector<std::unique_ptr<Symbol>> symbols;
+        /// Symbols whose code is emitted after the one being defined, the next one last.
+        std::vector<const Symbol*> pending;
+        /// Let bound values still holding their slot, see release_dead_values().
+        std::vector<Symbol*> releasable;
+        /// Slots of released values below the top, variables defined later are moved into them.
+        std::vector<size_t> free_slots;
+        /// Variables being defined, later code reads them from their slot.
+        std::vector<const Symbol*> defining;
+        /// Symbol whose value the function being compiled returns, see is_tail().
+        const Symbol* tail = nullptr;
+
+        /// Pure operation a result symbol computes, equal keys compute equal values.
+        struct Operation {
+            Program::InstructionType type;
+            const Symbol* first;
+            const Symbol* second;
+            Variant index;
+
+            bool operator==(const Operation& other) const {
+                return type == other.type && first == other.first && second == other.second
+                    && index.is_identical(other.index);
+            }
+        };
+        struct OperationHash {
+            size_t operator()(const Operation& operation) const;
+        };
+        /// Result symbols by the operation they compute, see new_symbol().
+        std::unordered_map<Operation, Symbol*, OperationHash> operations;
+        /// First literal operand of each value, equal literals are the same operand of an operation.
+        std::unordered_multimap<size_t, const Symbol*> literal_operands;
+
+        /// The symbol standing for operand in the key of an operation.
+        const Symbol* operation_operand(const Symbol& operand);
+
+        /// The symbol computing the same operation as symbol, symbol itself when it is the first.
+        Symbol& shared_operation(Symbol& symbol);
 
     public:
+        /// Marks symbols as emitted after the code being defined while it lives.
+        class PendingUses {
+            ProgramBuilder& builder;
+            /// Size of pending before the symbols were marked.
+            size_t start;
+
+        public:
+            PendingUses(ProgramBuilder& builder, const std::vector<Symbol*>& symbols);
+            PendingUses(const PendingUses&) = delete;
+            PendingUses& operator=(const PendingUses&) = delete;
+            ~PendingUses() { builder.pending.resize(std::min(builder.pending.size(), start)); }
+
+            /// Unmarks the first remaining symbol before its code is emitted.
+            void next();
+        };
+
+        /// State of the enclosing code while a function body is compiled.
+        struct FunctionBody {
+            EnclosingCode code;
+            std::vector<const Symbol*> pending;
+            std::vector<Symbol*> releasable;
+            std::vector<size_t> free_slots;
+            std::vector<const Symbol*> defining;
+            const Symbol* tail;
+        };
+
         using BytecodeBuilder::push;
         using BytecodeBuilder::assign;
         using BytecodeBuilder::assign_from_top;
@@ -25,12 +87,46 @@ namespace project {
         void assign(const Symbol &dest, T &&src);
         void assign_from_top(const Symbol &dest) { assign_from_top(dest.get_reference()); }
         void try_delete(const Symbol &object) { try_delete(object.get_reference()); }
+
+        [[nodiscard]] PendingUses pending_uses(const std::vector<Symbol*>& later) { return {*this, later}; }
+        /// Defines a let bound variable and releases the values it made dead. The value is moved
+        /// to the slot of a released one when there is any, so the stack does not grow.
+        void define_variable(Symbol &variable);
+        /// Stops tracking variables of a scope whose frame starting at frame_start ends. Those
+        /// moved below it are released, slots of the frame are no longer free.
+        void release_variables(const std::vector<Symbol*>& variables, StackAddress frame_start);
+        /// Destroys the tracked values no pending symbol can read anymore, so their memory
+        /// goes right after the last use instead of at the end of the enclosing let. Their
+        /// slots are reused by later variables.
+        void release_dead_values();
+        /// Starts an out of line function body, see BytecodeBuilder::begin_function(). Values of
+        /// the enclosing code are neither pending nor released inside of it.
+        FunctionBody begin_function(size_t frame_size);
+        FunctionAddress end_function(FunctionBody body);
+        void discard_function(FunctionBody body);
+        /// Whether the function being compiled returns the value of symbol right after its code,
+        /// so a call defining it can be a tail call.
+        [[nodiscard]] bool is_tail(const Symbol &symbol) const { return tail == &symbol; }
+        void set_tail(const Symbol &symbol) { tail = &symbol; }
+        /// Whether computing symbol may call a host function with side effects. Values with a
+        /// slot and the ones in computed_elsewhere are not computed again.
+        [[nodiscard]] bool has_effects(const Symbol &symbol, const std::vector<Symbol*> &computed_elsewhere = {}) const;
+        /// Variables of a scope together with the values its code reads more than once, each
+        /// after the values it is computed from. Values read only inside of a conditional
+        /// branch are left to the branch, see share_values(). Variables the code does not read
+        /// are dropped unless they have effects, the ones only a branch reads are left to it.
+        [[nodiscard]] std::vector<Symbol*> scope_variables(const std::vector<Symbol*> &variables, Symbol &expression) const;
+        /// Expression in a scope of its own when it reads a value more than once, so the value
+        /// is computed once into a slot.
+        Symbol& share_values(Symbol &expression);
         Symbol& compile(const ASTExpression &expression, Context& parent);
         Symbol& compile(std::istream &stream, Context& parent) { return compile(*compile_expression(stream), parent); }
         Symbol& compile(std::istream &stream) { Context parent; return compile(stream, parent); }
 
         template<typename ... TYPES>
         Context& new_context(Context& parent, TYPES &&...args);
+        /// Pure operations on the same operand symbols are created once, the existing symbol is
+        /// returned and its value computed once.
         template<typename T, typename ... TYPES>
         T& new_symbol(TYPES &&...args);
         Literal& new_literal(Literal literal) { return new_symbol<Literal>(std::move(literal)); }
@@ -77,7 +173,14 @@ void project::ProgramBuilder::assign(const Symbol &dest, T &&src) {
 template<typename T, typename ... TYPES>
 T& project::ProgramBuilder::new_symbol(TYPES &&...args) {
     static_assert(std::is_base_of_v<Symbol, T>, "New symbol must be a subclass of Symbol");
-    return *reinterpret_cast<T*>(symbols.emplace_back(std::make_unique<T>(std::forward<TYPES>(args)...)).get());
+    auto &symbol = *reinterpret_cast<T*>(symbols.emplace_back(std::make_unique<T>(std::forward<TYPES>(args)...)).get());
+    if constexpr (std::is_same_v<T, BinaryOperationResult> || std::is_same_v<T, GetSymbol>) {
+        if (auto &shared = shared_operation(symbol); &shared != &symbol) {
+            symbols.pop_back();
+            return static_cast<T&>(shared);
+        }
+    }
+    return symbol;
 }
 
 inline std::ostream& operator<<(std::ostream& stream, const project::Symbol& object) {
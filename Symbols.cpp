@@ -1,8 +1,10 @@
 #include "Symbols.h"
 
 //#include <bits/locale_facets_nonio.h>
+#include <algorithm>
 #include <functional>
-#include <functional>
+#include <ranges>
+#include <unordered_map>
 
 #include "ProgramBuilder.h"
 
@@ -85,11 +87,18 @@ void Symbol::declare(ProgramBuilder &builder) {
     reference.emplace(builder.push_unit());
 }
 
+void Symbol::destroy(ProgramBuilder &builder) {
+    if (is_declared())
+        builder.try_delete(*this);
+}
+
 void Symbol::push_or_define_in_place(ProgramBuilder &builder) {
     if (is_declared())
         builder.push(*reference);
-    else
+    else {
         define(builder);
+        reference.reset();
+    }
 }
 
 Symbol & ResultSymbol::overflow_literal_add(Literal &literal, ProgramBuilder &builder) {
@@ -219,17 +228,44 @@ void ResultSymbol::assign_or_declare_as_top(ProgramBuilder &builder) {
         reference.emplace(builder.stack_top());
 }
 
+std::vector<Symbol *> ScopeSymbol::operands() const {
+    auto result = variables;
+    result.push_back(&expression);
+    return result;
+}
+
 void ScopeSymbol::define(ProgramBuilder &builder) {
-    if (is_declared() == false)
-        declare(builder);
     auto frame = builder.new_stack_frame();
-    for (const auto &var : variables) {
-        if (var->needs_defining())
-            var->define(builder);
+    // Values the scope reads more than once are defined like its variables.
+    const auto scope_variables = builder.scope_variables(variables, expression);
+    auto later_symbols = scope_variables;
+    later_symbols.push_back(&expression);
+    auto later = builder.pending_uses(later_symbols);
+    std::vector<Symbol*> defined;
+    for (const auto &var : scope_variables) {
+        later.next();
+        // A variable naming an already declared value keeps reading its slot.
+        if (var->needs_defining() == false || var->is_declared())
+            continue;
+        builder.define_variable(*var);
+        defined.push_back(var);
     }
+    later.next();
+    if (builder.is_tail(*this))
+        builder.set_tail(expression);
     expression.push_or_define_in_place(builder);
-    assign_or_declare_as_top(builder);
-    frame.end_frame();
+    builder.release_variables(defined, frame.frame_start());
+    if (is_declared()) {
+        builder.assign_from_top(*this);
+        frame.end_frame();
+    }
+    else {
+        // The value takes the place of the frame, no slot is set aside for it beforehand.
+        frame.end_frame_below_top();
+        reference.emplace(builder.stack_top());
+    }
+    for (const auto var : defined)
+        var->forget_reference();
 }
 
 Symbol & UpdateSymbol::set(Variant index, Symbol &value, ProgramBuilder &builder) {
@@ -237,21 +273,37 @@ Symbol & UpdateSymbol::set(Variant index, Symbol &value, ProgramBuilder &builder
     return *this;
 }
 
+std::vector<Symbol *> UpdateSymbol::operands() const {
+    std::vector<Symbol*> result;
+    result.reserve(values.size() + 1);
+    result.push_back(&value);
+    for (const auto &entry : values)
+        result.push_back(entry.second);
+    return result;
+}
+
 void UpdateSymbol::define(ProgramBuilder &builder) {
+    auto later = builder.pending_uses(operands());
+    later.next();
     value.push_or_define_in_place(builder);
+    // When the updated map is not read anymore its slot is released, the copy on top stays
+    // the only reference and SET mutates it in place.
+    builder.release_dead_values();
     for (auto &[index, value]: values) {
+        later.next();
         builder.push(index);
         value->push_or_define_in_place(builder);
         builder.command(Program::SET);
     }
-
-    builder.assign_from_top(value);
+    assign_or_declare_as_top(builder);
 }
 
 void GetSymbol::define(ProgramBuilder &builder) {
     value.push_or_define_in_place(builder);
+    builder.release_dead_values();
     builder.push(index);
     builder.command(Program::GET);
+    assign_or_declare_as_top(builder);
 }
 
 void CurryResult::declare_dependencies(ProgramBuilder &builder) {
@@ -270,35 +322,210 @@ void CurryResult::delete_dependencies(ProgramBuilder &builder) {
 }
 
 void CurryResult::define(ProgramBuilder &builder) {
-    argument.push_or_define_in_place(builder);
-    function.push_or_define_in_place(builder);
-    builder.command({Program::CALL, 1});
+    // Curried calls whose partial results no slot holds pass all of their arguments to one
+    // CALL, a native function gets them at once instead of returning a closure per argument.
+    std::vector<Symbol*> passed{&argument};
+    Symbol *callable = &function;
+    for (auto curry = dynamic_cast<CurryResult *>(callable); curry != nullptr && curry->is_declared() == false;
+         curry = dynamic_cast<CurryResult *>(callable)) {
+        passed.push_back(&curry->argument);
+        callable = &curry->function;
+    }
+    std::ranges::reverse(passed);
+    std::vector later_symbols(passed.begin() + 1, passed.end());
+    later_symbols.push_back(callable);
+    auto later = builder.pending_uses(later_symbols);
+    passed.front()->push_or_define_in_place(builder);
+    for (const auto value : passed | std::views::drop(1)) {
+        later.next();
+        value->push_or_define_in_place(builder);
+    }
+    later.next();
+    callable->push_or_define_in_place(builder);
+    builder.command({Program::CALL, static_cast<Program::word>(passed.size())});
     assign_or_declare_as_top(builder);
 }
 
 void ConditionalResult::define(ProgramBuilder &builder) {
+    auto later = builder.pending_uses({&else_do, &then_do});
+    // Both branches return the value of a conditional in tail position.
+    const bool tail = builder.is_tail(*this);
+    auto &else_value = builder.share_values(else_do);
+    auto &then_value = builder.share_values(then_do);
     condition.push_or_define_in_place(builder);
     const auto condition_jump = builder.jump_if_stack_top_positive();
-    builder.virtual_push();
 
     auto else_frame = builder.new_stack_frame();
     else_frame.pop_variables = false;
-    else_do.push_or_define_in_place(builder);
+    later.next();
+    if (tail)
+        builder.set_tail(else_value);
+    else_value.push_or_define_in_place(builder);
     const auto else_jump = builder.unconditional_jump();
     else_frame.end_frame();
 
     auto then_frame = builder.new_stack_frame();
     then_frame.pop_variables = false;
     const auto then_start = builder.next_instruction_address();
-    then_do.push_or_define_in_place(builder);
+    later.next();
+    if (tail)
+        builder.set_tail(then_value);
+    then_value.push_or_define_in_place(builder);
     const auto then_end = builder.next_instruction_address();
     then_frame.end_frame();
 
     builder.update_jump_location(condition_jump, then_start);
     builder.update_jump_location(else_jump, then_end);
+    // Either branch leaves its value right above the condition.
+    builder.virtual_push();
     assign_or_declare_as_top(builder);
 }
 
+InlineFunction::InlineFunction(Context context, std::unique_ptr<ASTExpression> body, std::vector<std::string> &&parameter_names)
+    : FunctionSymbol(parameter_names.size()), context(std::move(context)),
+    body(std::move(body)), parameter_names(std::move(parameter_names)) {
+    this->body->read_names(body_names);
+}
+
+std::vector<Symbol *> InlineFunction::operands() const {
+    std::vector<Symbol*> result;
+    for (const auto &name : body_names)
+        if (const auto symbol = context.evaluate(name))
+            result.push_back(symbol);
+    return result;
+}
+
+void ParameterSymbol::push_or_define_in_place(ProgramBuilder &builder) {
+    read = true;
+    ResultSymbol::push_or_define_in_place(builder);
+}
+
+namespace {
+    /// Symbols an out of line body reads instead of the captured ones, nothing it reaches
+    /// lives in the enclosing frame. Values become ParameterSymbols following the arguments,
+    /// literals are copied and functions are rebound the same way.
+    class CaptureRebinding {
+    public:
+        /// Every captured value gets a slot unless passed lists the ones that do.
+        CaptureRebinding(ProgramBuilder &builder, const size_t first_slot, const std::vector<Symbol*> *passed)
+            : builder(builder), first_slot(first_slot), passed(passed) {}
+
+        /// Captured values with a slot, in the order of the slots.
+        std::vector<std::pair<Symbol*, ParameterSymbol*>> captures;
+        /// Set when a captured symbol cannot be rebound.
+        bool failed = false;
+
+        /// Reads of symbol become reads of replacement.
+        void replace(Symbol &symbol, Symbol &replacement) { rebound.emplace(&symbol, &replacement); }
+
+        Context rebind(const Context &context) {
+            Context result;
+            for (const auto &[name, symbol] : context.table)
+                result.new_symbol(name, rebind(*symbol));
+            return result;
+        }
+
+    private:
+        ProgramBuilder &builder;
+        size_t first_slot;
+        const std::vector<Symbol*> *passed;
+        std::unordered_map<Symbol*, Symbol*> rebound;
+
+        Symbol &rebind(Symbol &symbol) {
+            if (const auto found = rebound.find(&symbol); found != rebound.end())
+                return *found->second;
+            if (const auto function = dynamic_cast<InlineFunction *>(&symbol)) {
+                auto &copy = builder.new_symbol<InlineFunction>(Context(), function->body->copy(), function->parameter_names);
+                copy.recursive = function->recursive;
+                rebound.emplace(&symbol, &copy);
+                copy.context.table = rebind(function->context).table;
+                return copy;
+            }
+            Symbol *result;
+            if (dynamic_cast<FunctionSymbol *>(&symbol) != nullptr) {
+                failed = true;
+                result = &symbol;
+            }
+            else if (const auto literal = dynamic_cast<Literal *>(&symbol))
+                result = &builder.new_literal(Literal(**literal, literal->is_pure()));
+            else if (passed == nullptr)
+                result = &new_capture(symbol);
+            else if (std::ranges::find(*passed, &symbol) != passed->end())
+                result = &new_capture(symbol);
+            else
+                result = &builder.new_symbol<ParameterSymbol>();
+            rebound.emplace(&symbol, result);
+            return *result;
+        }
+
+        ParameterSymbol &new_capture(Symbol &symbol) {
+            auto &parameter = builder.new_symbol<ParameterSymbol>(StackAddress(first_slot + captures.size()));
+            captures.emplace_back(&symbol, &parameter);
+            return parameter;
+        }
+    };
+}
+
+const std::optional<InlineFunction::Subroutine> & InlineFunction::out_of_line(ProgramBuilder &builder) {
+    if (compiled)
+        return subroutine;
+    compiled = true;
+    // The first pass gives every captured value a slot, when the body does not read all of
+    // them the second one passes only those it does.
+    std::optional<std::vector<Symbol*>> passed;
+    while (true) {
+        CaptureRebinding rebinding(builder, parameter_count, passed.has_value() ? &*passed : nullptr);
+        InlineFunction *self = nullptr;
+        if (recursive) {
+            self = &builder.new_symbol<InlineFunction>(Context(), body->copy(), parameter_names);
+            self->recursive = true;
+            rebinding.replace(*this, *self);
+        }
+        auto body_context = rebinding.rebind(context);
+        if (rebinding.failed)
+            return subroutine;
+        const size_t frame_size = parameter_count + rebinding.captures.size();
+        auto function = builder.begin_function(frame_size);
+        try {
+            if (self != nullptr) {
+                std::vector<Symbol*> captures;
+                for (const auto &parameter : rebinding.captures | std::views::values)
+                    captures.push_back(parameter);
+                self->context.table = body_context.table;
+                self->compiled = true;
+                self->subroutine.emplace(function.code.function, std::move(captures));
+            }
+            for (size_t i = 0; i < parameter_count; ++i)
+                body_context.new_symbol(parameter_names[i], builder.new_symbol<ParameterSymbol>(StackAddress(i)));
+            auto &result = builder.share_values(body->create_symbols(builder, body_context));
+            builder.set_tail(result);
+            result.push_or_define_in_place(builder);
+        }
+        catch (...) {
+            // The enclosing code unwinds with its own stack and pending symbols.
+            builder.discard_function(std::move(function));
+            throw;
+        }
+        std::vector<Symbol*> read;
+        for (const auto &[captured, parameter] : rebinding.captures)
+            if (parameter->is_read())
+                read.push_back(captured);
+        if (read.size() != rebinding.captures.size()) {
+            builder.discard_function(std::move(function));
+            passed = std::move(read);
+            continue;
+        }
+        const size_t size = builder.next_instruction_address().offset;
+        const bool small = recursive == false && size <= max_inlined_size + frame_size;
+        if (frame_size > Program::max_call_arguments || small) {
+            builder.discard_function(std::move(function));
+            return subroutine;
+        }
+        subroutine.emplace(builder.end_function(std::move(function)), std::move(read));
+        return subroutine;
+    }
+}
+
 Symbol & InlineFunction::curry(Symbol &symbol, ProgramBuilder &builder) {
     return builder.new_symbol<FunctionResult>(FunctionResult(*this, {&symbol}));
 }
@@ -324,17 +551,66 @@ void FunctionResult::declare(ProgramBuilder &builder) {
     ResultSymbol::declare(builder);
 }
 
+std::vector<Symbol *> FunctionResult::operands() const {
+    auto result = arguments;
+    result.push_back(&function_symbol);
+    return result;
+}
+
 void FunctionResult::define(ProgramBuilder &builder) {
     if (arguments.size() != function_symbol.parameter_count)
         throw InvalidNumberOfArguments(function_symbol, arguments.size(), arguments.size() + 1);
+    // A call folding to a literal needs no code and functions cannot be passed as arguments.
+    const bool passable = std::ranges::none_of(arguments, [](Symbol *argument) {
+        return dynamic_cast<FunctionSymbol *>(argument) != nullptr;
+    });
+    if (function_symbol.recursive) {
+        const auto &subroutine = passable ? function_symbol.out_of_line(builder) : std::nullopt;
+        if (subroutine.has_value() == false)
+            throw ProjectError("Recursive function cannot be compiled out of line");
+        call(builder, *subroutine);
+        return;
+    }
+    // Once the body has a subroutine, a call with a value known only at run time uses it without
+    // building the symbols of the body again, only known arguments may still fold the body.
+    const auto subroutine = function_symbol.compiled_subroutine();
+    if (passable && subroutine != nullptr && std::ranges::any_of(arguments, [](Symbol *argument) {
+        return dynamic_cast<Literal *>(argument) == nullptr;
+    })) {
+        call(builder, *subroutine);
+        return;
+    }
     auto context = function_symbol.context;
     for (int i = 0; i < arguments.size(); ++i)
         context.new_symbol(function_symbol.parameter_names.at(i), *arguments.at(i));
     result_symbol = &function_symbol.body->create_symbols(builder, context);
+    if (passable && dynamic_cast<Literal *>(result_symbol) == nullptr) {
+        if (const auto &subroutine = function_symbol.out_of_line(builder); subroutine.has_value()) {
+            call(builder, *subroutine);
+            return;
+        }
+    }
+    result_symbol = &builder.share_values(*result_symbol);
     result_symbol->push_or_define_in_place(builder);
     assign_or_declare_as_top(builder);
 }
 
+void FunctionResult::call(ProgramBuilder &builder, const InlineFunction::Subroutine &subroutine) {
+    auto passed = arguments;
+    passed.insert(passed.end(), subroutine.captures.begin(), subroutine.captures.end());
+    auto later = builder.pending_uses(passed);
+    for (const auto value : passed) {
+        later.next();
+        value->push_or_define_in_place(builder);
+    }
+    // A tail call reuses the frame, which has to hold at least the passed values below them.
+    if (builder.is_tail(*this) && builder.current_stack_pointer() >= 2 * passed.size())
+        builder.tail_call_local(subroutine.address, passed.size());
+    else
+        builder.call_local(subroutine.address, passed.size());
+    assign_or_declare_as_top(builder);
+}
+
 
 Symbol & Literal::overflow_literal_add(Literal &literal, ProgramBuilder &builder) {
     auto result = value.overflow_add(literal.value);
@@ -371,8 +647,41 @@ Symbol & Literal::overflow_literal_mod(Literal &literal, ProgramBuilder &builder
     return builder.new_symbol<Literal>(result.value());
 }
 
-void Literal::destroy(ProgramBuilder &builder) {
-    builder.assign(reference.value(), Variant());
+Symbol & Literal::curry(Symbol &symbol, ProgramBuilder &builder) {
+    const auto argument = dynamic_cast<Literal *>(&symbol);
+    if (pure == false || argument == nullptr)
+        return ResultSymbol::curry(symbol, builder);
+    // Only a partial application of a pure function is pure as well, a function the call
+    // returns may have side effects.
+    const bool partial = value.type() == Variant::Type::FUNCTION && value.arity() > 1;
+    std::vector arguments = {argument->value};
+    try {
+        return builder.new_literal(Literal(Variant(value).call(arguments), partial));
+    }
+    catch (const std::exception &) {
+        // The call fails when the program runs, if it ever reaches it.
+        return ResultSymbol::curry(symbol, builder);
+    }
+}
+
+Symbol & Literal::get(Variant index, ProgramBuilder &builder) {
+    // A missing entry fails when the program runs, like GET on any other map.
+    auto entry = value.get(index);
+    if (entry.has_value() == false)
+        return ResultSymbol::get(std::move(index), builder);
+    return builder.new_literal(Literal(std::move(entry.value())));
+}
+
+Symbol & Literal::or_else(Symbol &symbol, ProgramBuilder &builder) {
+    if (const auto literal = dynamic_cast<Literal *>(&symbol))
+        return builder.new_literal(Literal(value.or_else(literal->value)));
+    return ResultSymbol::or_else(symbol, builder);
+}
+
+Symbol & Literal::and_else(Symbol &symbol, ProgramBuilder &builder) {
+    if (const auto literal = dynamic_cast<Literal *>(&symbol))
+        return builder.new_literal(Literal(value.and_else(literal->value)));
+    return ResultSymbol::and_else(symbol, builder);
 }
 
 void Literal::declare(ProgramBuilder &builder) {
@@ -396,7 +705,9 @@ void BinaryOperationResult::define_dependencies(ProgramBuilder &builder) {
 }
 
 void BinaryOperationResult::define(ProgramBuilder &builder) {
+    auto later = builder.pending_uses({&right_operand});
     left_operand.push_or_define_in_place(builder);
+    later.next();
     right_operand.push_or_define_in_place(builder);
     builder.command(static_cast<BytecodeBuilder::Instruction>(type));
     assign_or_declare_as_top(builder);
@@ -1,7 +1,9 @@
 #ifndef SYMBOLS_H
 #define SYMBOLS_H
 
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "BytecodeBuilder.h"
 
@@ -14,10 +16,16 @@ namespace project {
     public:
         [[nodiscard]] bool is_declared() const { return reference.has_value(); }
         [[nodiscard]] StackAddress get_reference() const { return reference.value(); }
+        /// The slot no longer holds the value, code reading it later computes it again.
+        void forget_reference() { reference.reset(); }
+        /// The value was moved to slot, see ProgramBuilder::define_variable().
+        void move_reference(const StackAddress slot) { reference.emplace(slot); }
 
         [[nodiscard]] virtual bool is_known() const { return false; }
         [[nodiscard]] virtual bool is_trivially_destructible() const { return false; }
         [[nodiscard]] virtual std::string error_representation() const { return "<unknown>"; }
+        /// Symbols whose values the code emitted by define() may read.
+        [[nodiscard]] virtual std::vector<Symbol*> operands() const { return {}; }
 
         virtual Symbol& overflow_literal_add(Literal& literal, ProgramBuilder& builder);
         virtual Symbol& overflow_literal_sub(Literal& literal, ProgramBuilder& builder);
@@ -49,10 +57,13 @@ namespace project {
         virtual void define_dependencies(ProgramBuilder& builder) {}
         virtual void define(ProgramBuilder& builder) = 0;
         virtual void delete_dependencies(ProgramBuilder& builder) {}
-        virtual void destroy(ProgramBuilder& builder) {}
+        /// Releases the value held in the symbol's slot.
+        virtual void destroy(ProgramBuilder& builder);
 
         virtual bool needs_defining() { return true; }
 
+        /// Pushes the value from its slot, or computes it on top of the stack for the code
+        /// consuming it. A value computed in place keeps no slot.
         virtual void push_or_define_in_place(ProgramBuilder& builder);
 
         virtual ~Symbol() = default;
@@ -103,6 +114,8 @@ namespace project {
             : expression(expression) {
         }
 
+        /// The variables followed by the expression.
+        [[nodiscard]] std::vector<Symbol*> operands() const override;
         void define(ProgramBuilder &builder) override;
 
     private:
@@ -112,19 +125,34 @@ namespace project {
 
     class Literal final : public ResultSymbol {
         const Variant value;
+        /// The value is a function without side effects, calls with known arguments are
+        /// evaluated while compiling.
+        const bool pure;
 
     public:
-        explicit Literal(Variant value) : value(std::move(value)) {}
+        explicit Literal(Variant value, const bool pure = false) : value(std::move(value)), pure(pure) {}
         template<class T>
         static Literal integer(T value) { return Literal(Variant::integer(value)); }
         template<class T>
         static Literal floating_point(T value) { return Literal(Variant::floating_point(value)); }
         static Literal unit() { return Literal(Variant()); };
-        static Literal function(Variant::function function) { return Literal(Variant(std::move(function))); }
+        static Literal function(Variant::function function, const bool pure = false)
+            { return Literal(Variant(std::move(function)), pure); }
+        /// Host function called with all of its arguments at once, see Variant::native().
+        template<class SIGNATURE, class FUNCTOR>
+        static Literal native(FUNCTOR functor, const bool pure = false)
+            { return Literal(Variant::native<SIGNATURE>(std::move(functor)), pure); }
         static Literal map(Variant::map map) { return Literal(Variant(std::move(map))); }
 
         [[nodiscard]] bool is_known() const override { return true; }
-        [[nodiscard]] bool is_trivially_destructible() const override { return true; }
+        [[nodiscard]] bool is_trivially_destructible() const override { return value.is_inlined(); }
+        [[nodiscard]] bool is_pure() const { return pure; }
+
+        Symbol& curry(Symbol& symbol, ProgramBuilder& builder) override;
+        /// A present entry of a known map is known too.
+        Symbol& get(Variant index, ProgramBuilder& builder) override;
+        Symbol& or_else(Symbol& symbol, ProgramBuilder& builder) override;
+        Symbol& and_else(Symbol& symbol, ProgramBuilder& builder) override;
 
         Symbol& overflow_literal_add(Literal& literal, ProgramBuilder& builder) override;
         Symbol& overflow_literal_sub(Literal& literal, ProgramBuilder& builder) override;
@@ -147,7 +175,6 @@ namespace project {
         void declare_dependencies(ProgramBuilder& builder) override {}
         void define_dependencies(ProgramBuilder& builder) override {}
         void delete_dependencies(ProgramBuilder &builder) override {}
-        void destroy(ProgramBuilder& builder) override;
         void declare(ProgramBuilder& builder) override;
         void define(ProgramBuilder& builder) override;
 
@@ -173,6 +200,7 @@ namespace project {
 
         Symbol &set(Variant index, Symbol &value, ProgramBuilder &builder) override;
 
+        [[nodiscard]] std::vector<Symbol*> operands() const override;
         void define(ProgramBuilder &builder) override;
     };
 
@@ -182,6 +210,7 @@ namespace project {
 
         GetSymbol(Symbol& value, Variant index) : value(value), index(std::move(index)) {}
 
+        [[nodiscard]] std::vector<Symbol*> operands() const override { return {&value}; }
         void define(ProgramBuilder &builder) override;
     };
 
@@ -195,8 +224,8 @@ namespace project {
         void declare_dependencies(ProgramBuilder &builder) override;
         void define_dependencies(ProgramBuilder &builder) override;
         void delete_dependencies(ProgramBuilder &builder) override;
+        [[nodiscard]] std::vector<Symbol*> operands() const override { return {&function, &argument}; }
         void define(ProgramBuilder &builder) override;
-        void destroy(ProgramBuilder &builder) override {}
     };
 
     struct ConditionalResult : ResultSymbol {
@@ -207,8 +236,8 @@ namespace project {
         ConditionalResult(Symbol &condition, Symbol &then_do, Symbol &else_do)
             : condition(condition), then_do(then_do), else_do(else_do) {}
 
+        [[nodiscard]] std::vector<Symbol*> operands() const override { return {&condition, &then_do, &else_do}; }
         void define(ProgramBuilder &builder) override;
-        void destroy(ProgramBuilder &builder) override {}
 
     };
 
@@ -250,23 +279,67 @@ namespace project {
 
         void declare_dependencies(ProgramBuilder &builder) override;
         void define_dependencies(ProgramBuilder &builder) override;
+        [[nodiscard]] std::vector<Symbol*> operands() const override { return {&left_operand, &right_operand}; }
         void define(ProgramBuilder &builder) override;
         void destroy(ProgramBuilder &builder) override;
 
     };
 
+    /// Value passed to a function compiled out of line, it lives in the function's frame.
+    /// Without a slot it stands for a captured value the function is not passed.
+    class ParameterSymbol final : public ResultSymbol {
+        bool read = false;
+
+    public:
+        ParameterSymbol() = default;
+        explicit ParameterSymbol(const StackAddress slot) { reference.emplace(slot); }
+
+        /// Whether code pushing the value was emitted.
+        [[nodiscard]] bool is_read() const { return read; }
+
+        void define(ProgramBuilder &builder) override { throw std::logic_error("Captured value is not passed to the function"); }
+        void push_or_define_in_place(ProgramBuilder &builder) override;
+    };
+
     struct InlineFunction final : public FunctionSymbol {
+        /// Bodies of at most this many instructions besides one push per passed value are
+        /// inlined into every call, a call would not be much shorter.
+        static constexpr size_t max_inlined_size = 8;
+
+        /// Body shared by all calls, see out_of_line().
+        struct Subroutine {
+            FunctionAddress address;
+            /// Values the body reads from the context, passed after the arguments.
+            std::vector<Symbol*> captures;
+        };
+
         Context context;
         std::unique_ptr<ASTExpression> body;
         std::vector<std::string> parameter_names;
+        /// The context holds the function itself, every call is compiled out of line.
+        bool recursive = false;
 
-        InlineFunction(Context context, std::unique_ptr<ASTExpression> body, std::vector<std::string>&& parameter_names)
-            : FunctionSymbol(parameter_names.size()), context(std::move(context)),
-            body(std::move(body)), parameter_names(std::move(parameter_names)) {}
+        InlineFunction(Context context, std::unique_ptr<ASTExpression> body, std::vector<std::string>&& parameter_names);
         InlineFunction(Context context, std::unique_ptr<ASTExpression> body, const std::vector<std::string>& parameter_names)
             : InlineFunction(std::move(context), std::move(body), std::vector(parameter_names)) {}
 
+        /// The symbols of the context the body names, every call of the function may read them.
+        [[nodiscard]] std::vector<Symbol*> operands() const override;
         Symbol &curry(Symbol &symbol, ProgramBuilder &builder) override;
+        /// Compiles the body into a function at the first call. Empty when calls inline the
+        /// body instead, because it is small or captures something that cannot be passed.
+        /// Recursive functions are never inlined, inside of the body they call themselves
+        /// through a copy whose captures are the slots of the running frame.
+        const std::optional<Subroutine>& out_of_line(ProgramBuilder &builder);
+        /// The subroutine an earlier call compiled the body into, nullptr when there is none.
+        [[nodiscard]] const Subroutine* compiled_subroutine() const
+            { return subroutine.has_value() ? &*subroutine : nullptr; }
+
+    private:
+        /// Names the body evaluates, see operands().
+        std::unordered_set<std::string> body_names;
+        bool compiled = false;
+        std::optional<Subroutine> subroutine;
     };
 
     class FunctionResult final : public ResultSymbol {
@@ -281,8 +354,11 @@ namespace project {
         Symbol &curry(Symbol &symbol, ProgramBuilder &builder) override;
         void declare_dependencies(ProgramBuilder &builder) override;
         void declare(ProgramBuilder &builder) override;
+        [[nodiscard]] std::vector<Symbol*> operands() const override;
         void define(ProgramBuilder &builder) override;
 
+    private:
+        void call(ProgramBuilder &builder, const InlineFunction::Subroutine &subroutine);
     };
 
 
@@ -88,6 +88,21 @@ TEST(ASTTest, ASTLetFunctionWithValue) {
     ASSERT_EQ(function->parameter_names.at(0), "x");
 }
 
+TEST(ASTTest, ASTRecursiveLetCopiesCalls) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let rec f : x = f x in 42";
+    auto ast = builder.compile_expression(code);
+
+    const auto copy = ast->copy();
+    const auto let_in = dynamic_cast<ASTLetExpression*>(copy.get());
+    ASSERT_NE(let_in, nullptr);
+    ASSERT_TRUE(let_in->recursive);
+    const auto function = dynamic_cast<ASTFunction*>(let_in->assign.get());
+    ASSERT_NE(function, nullptr);
+    ASSERT_NE(dynamic_cast<ASTCurry*>(function->body.get()), nullptr);
+}
+
 TEST(ASTTest, ASTComplexExpressionWithLetAndAdditions) {
     ProgramBuilder builder;
     std::stringstream code;
@@ -155,4 +170,31 @@ TEST(ASTTest, ASTComplexLetWithIfElseAndMap) {
     const auto second_entry = dynamic_cast<ASTInteger*>(map->map.at("another_key").get());
     ASSERT_NE(second_entry, nullptr);
     ASSERT_EQ(second_entry->value, "42");
-}
\ No newline at end of file
+}
+
+TEST(ASTTest, KnownMapLiteralIsOneConstant) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "{ 1 = 2 , 3 = { 4 = 5 } } with { 6 = 7 }";
+    builder.compile(code);
+    const auto program = builder.build();
+    ASSERT_EQ(program.instructions.size(), 1);
+    ASSERT_EQ(program.instructions.at(0).type, Program::PUSH_CONST);
+    const auto result = program.run();
+    ASSERT_EQ(result.get(Variant::integer(1)), Variant::integer(2));
+    ASSERT_EQ(result.get(Variant::integer(3))->get(Variant::integer(4)), Variant::integer(5));
+    ASSERT_EQ(result.get(Variant::integer(6)), Variant::integer(7));
+}
+
+TEST(ASTTest, MapLiteralSetsOnlyUnknownEntries) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let f : x = x in { 1 = 2 , 3 = f 4 , 5 = 6 }";
+    builder.compile(code);
+    const auto program = builder.build();
+    ASSERT_EQ(std::ranges::count(program.instructions, Program::SET, &Program::Instruction::type), 1);
+    const auto result = program.run();
+    ASSERT_EQ(result.get(Variant::integer(1)), Variant::integer(2));
+    ASSERT_EQ(result.get(Variant::integer(3)), Variant::integer(4));
+    ASSERT_EQ(result.get(Variant::integer(5)), Variant::integer(6));
+}
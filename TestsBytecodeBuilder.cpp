@@ -48,6 +48,107 @@ TEST(BytecodeBuilderTest, PushConstantRefValue) {
     ASSERT_EQ(builder.next_instruction_address(), InstructionAddress(1));
 }
 
+TEST(BytecodeBuilderTest, IdenticalConstantsAreStoredOnce) {
+    BytecodeBuilder builder;
+    auto first_map = Variant::empty_map();
+    static_cast<void>(first_map.set(Variant::integer(1), Variant::integer(2)));
+    auto second_map = Variant::empty_map();
+    static_cast<void>(second_map.set(Variant::integer(1), Variant::integer(2)));
+
+    const auto five = builder.new_constant(Variant::integer(5));
+    ASSERT_EQ(builder.new_constant(Variant::integer(5)), five);
+    ASSERT_NE(builder.new_constant(Variant::floating_point(5.0)), five);
+    const auto map = builder.new_constant(first_map);
+    ASSERT_EQ(builder.new_constant(second_map), map);
+    builder.push_unit();
+    builder.push_unit();
+
+    const auto statistics = builder.constant_pool_statistics();
+    ASSERT_EQ(statistics.requested, 7);
+    ASSERT_EQ(statistics.stored, 4);
+    ASSERT_EQ(statistics.reused(), 3);
+    ASSERT_EQ(builder.build().constants.size(), 4);
+}
+
+TEST(BytecodeBuilderTest, BuildStartsConstantPoolStatisticsAgain) {
+    BytecodeBuilder builder;
+    builder.new_constant(Variant::integer(5));
+    builder.new_constant(Variant::integer(5));
+    ASSERT_EQ(builder.build().constants.size(), 1);
+    ASSERT_EQ(builder.constant_pool_statistics().requested, 0);
+    ASSERT_EQ(builder.constant_pool_statistics().stored, 0);
+
+    builder.new_constant(Variant::integer(5));
+    const auto statistics = builder.constant_pool_statistics();
+    ASSERT_EQ(statistics.requested, 1);
+    ASSERT_EQ(statistics.stored, 1);
+    ASSERT_EQ(builder.build().constants.size(), 1);
+}
+
+TEST(BytecodeBuilderTest, ConstantsDifferingInsideMapsAreKept) {
+    BytecodeBuilder builder;
+    auto integer_map = Variant::empty_map();
+    static_cast<void>(integer_map.set(Variant::integer(1), Variant::integer(2)));
+    auto floating_map = Variant::empty_map();
+    static_cast<void>(floating_map.set(Variant::integer(1), Variant::floating_point(2.0)));
+
+    ASSERT_NE(builder.new_constant(integer_map), builder.new_constant(floating_map));
+    ASSERT_NE(builder.new_constant(Variant::floating_point(0.0)), builder.new_constant(Variant::floating_point(-0.0)));
+    ASSERT_EQ(builder.constant_pool_statistics().stored, 4);
+}
+
+TEST(BytecodeBuilderTest, BuildRemovesRedundantInstructions) {
+    BytecodeBuilder builder;
+    const auto first = builder.push(1);
+    const auto second = builder.push(2);
+    builder.push(3);
+    builder.push(5);
+    builder.pop();
+    builder.assign_from_top(second);
+    builder.assign_from_top(first);
+    const auto jump = builder.unconditional_jump();
+    builder.update_jump_location(jump, builder.next_instruction_address());
+    builder.push(6);
+    builder.push(7);
+    builder.pop();
+    builder.pop();
+
+    auto program = builder.build();
+    const auto statistics = builder.peephole_statistics();
+    ASSERT_EQ(statistics.emitted, 15);
+    ASSERT_EQ(statistics.built, 5);
+    ASSERT_EQ(statistics.removed(), 10);
+    ASSERT_EQ(program.instructions.at(3).type, Program::SWAP);
+    ASSERT_EQ(program.instructions.at(3).argument, 2);
+    ASSERT_EQ(program.instructions.at(4).type, Program::POP);
+    ASSERT_EQ(program.instructions.at(4).argument, 2);
+    program.verify();
+    ASSERT_EQ(program.execute(), std::vector{Variant::integer(3)});
+}
+
+TEST(BytecodeBuilderTest, BuildRetargetsJumpsOverRemovedInstructions) {
+    BytecodeBuilder builder;
+    const auto counter = builder.push(3);
+    const auto loop = builder.next_instruction_address();
+    builder.push(9);
+    builder.pop();
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    const auto again = builder.jump_if_positive(counter);
+    const auto exit = builder.unconditional_jump();
+    builder.update_jump_location(again, builder.next_instruction_address());
+    builder.update_jump_location(builder.unconditional_jump(), loop);
+    builder.update_jump_location(exit, builder.next_instruction_address());
+
+    auto program = builder.build();
+    // The loop jumps back right away, neither of the unconditional jumps is left.
+    ASSERT_EQ(builder.peephole_statistics().built, 8);
+    ASSERT_EQ(program.instructions.at(7).type, Program::JUMP_IF_POSITIVE);
+    ASSERT_EQ(program.instructions.at(7).argument, 1);
+    program.verify();
+    ASSERT_EQ(program.execute(), std::vector{Variant::integer(0)});
+}
+
 TEST(BytecodeBuilderTest, StackTopReturnsLastPushedValue) {
     BytecodeBuilder builder;
 
@@ -0,0 +1,29 @@
+#include <gtest/gtest.h>
+#include "BytecodeStatistics.h"
+
+using namespace project;
+
+TEST(BytecodeStatisticsTest, CountsNgramsOutsideJumpTargets) {
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::PUSH_IMMEDIATE, 3},
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::JUMP_IF_POSITIVE, 5},
+    }, {});
+    NgramCounter counter(2);
+    counter.add(program);
+    counter.add(program);
+
+    ASSERT_EQ(counter.total(), 8);
+    ASSERT_EQ(counter.count({Program::PUSH_IMMEDIATE, Program::PUSH_IMMEDIATE}), 4);
+    ASSERT_EQ(counter.count({Program::PUSH_IMMEDIATE, Program::JUMP_IF_POSITIVE}), 0);
+    const auto frequent = counter.most_frequent(1);
+    ASSERT_EQ(frequent.size(), 1);
+    ASSERT_EQ(frequent.at(0).second, 4);
+
+    std::stringstream report;
+    counter.report(report, 1);
+    ASSERT_NE(report.str().find("PUSH_IMMEDIATE PUSH_IMMEDIATE"), std::string::npos);
+}
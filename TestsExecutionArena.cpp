@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include "BytecodeBuilder.h"
+
+using namespace project;
+
+static Program squares(const size_t count) {
+    BytecodeBuilder builder;
+
+    builder.push(Variant::empty_map());
+    for (size_t i = 0; i < count; ++i)
+        builder.stack_top_set(i * 7919, i * i);
+    return builder.build();
+}
+
+TEST(ExecutionArenaTest, ResultsOutliveTheRun) {
+    const auto program = squares(100);
+    Variant first = program.run();
+    Variant second = program.run();
+
+    ASSERT_EQ(first, second);
+    ASSERT_TRUE(first.set(Variant::integer(1), Variant::integer(2)));
+    ASSERT_EQ(first.get(Variant::integer(99 * 7919)), Variant::integer(99 * 99));
+    ASSERT_EQ(second.get(Variant::integer(1)), std::nullopt);
+}
+
+TEST(ExecutionArenaTest, ValuesKeptByFunctionsOutliveTheRun) {
+    std::vector<Variant> kept;
+    BytecodeBuilder builder;
+
+    const auto keep = builder.push(Variant([&kept](const Variant &value) {
+        kept.push_back(value);
+        return Variant();
+    }));
+    builder.push(Variant::empty_map());
+    for (size_t i = 0; i < 50; ++i) {
+        builder.stack_top_set(i, i + 1);
+        builder.call(keep, builder.stack_top());
+        builder.pop();
+    }
+    const auto program = builder.build();
+    static_cast<void>(program.execute());
+
+    ASSERT_EQ(kept.size(), 50);
+    ASSERT_EQ(kept.back().get(Variant::integer(49)), Variant::integer(50));
+    ASSERT_EQ(kept.front().get(Variant::integer(1)), std::nullopt);
+    std::thread([moved = std::move(kept)] {
+        ASSERT_EQ(moved.at(10).get(Variant::integer(10)), Variant::integer(11));
+    }).join();
+}
+
+TEST(ExecutionArenaTest, NestedRunsShareTheArena) {
+    const auto inner = squares(40);
+    BytecodeBuilder builder;
+
+    const auto run_inner = builder.push(Variant([&inner](const Variant &) {
+        return inner.run();
+    }));
+    builder.call(run_inner, 0);
+    builder.call(run_inner, 0);
+    const auto result = builder.build().execute();
+
+    ASSERT_EQ(result.at(1), result.at(2));
+    ASSERT_EQ(result.at(2).get(Variant::integer(39 * 7919)), Variant::integer(39 * 39));
+}
+
+TEST(ExecutionArenaTest, FailedRunKeepsStackValid) {
+    BytecodeBuilder builder;
+
+    builder.push(Variant::empty_map());
+    builder.stack_top_set(5, 6);
+    builder.get(builder.stack_top(), 4);
+    const auto program = builder.build();
+
+    std::vector<Variant> stack;
+    ASSERT_THROW(program.execute(stack), ProjectError);
+    ASSERT_EQ(stack.at(0).get(Variant::integer(5)), Variant::integer(6));
+}
@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include "FlatMap.h"
+
+using namespace project;
+
+TEST(FlatMapTest, InsertFindAndExtract) {
+    FlatMap<long long, int> map;
+    ASSERT_EQ(map.find(1), nullptr);
+    for (long long key = -3000; key < 3000; key += 3)
+        ASSERT_TRUE(map.insert_or_assign(key * 7919, static_cast<int>(key)));
+    ASSERT_FALSE(map.insert_or_assign(0, 5));
+    ASSERT_EQ(map.size(), 2000);
+    ASSERT_EQ(*map.find(-3000 * 7919), -3000);
+    ASSERT_EQ(*map.find(0), 5);
+    ASSERT_EQ(map.find(1), nullptr);
+
+    for (long long key = -3000; key < 3000; key += 6)
+        ASSERT_EQ(map.extract(key * 7919), key == 0 ? 5 : key);
+    ASSERT_EQ(map.extract(0), std::nullopt);
+    ASSERT_EQ(map.size(), 1000);
+    for (long long key = -2997; key < 3000; key += 6)
+        ASSERT_EQ(*map.find(key * 7919), key);
+    ASSERT_EQ(map.find(-3000 * 7919), nullptr);
+}
+
+TEST(FlatMapTest, DeletedSlotsAreReused) {
+    FlatMap<long long, int> map;
+    for (int round = 0; round < 100; ++round) {
+        for (long long key = 0; key < 50; ++key)
+            ASSERT_TRUE(map.insert_or_assign(round * 100 + key, round));
+        for (long long key = 0; key < 50; ++key)
+            ASSERT_EQ(map.extract(round * 100 + key), round);
+    }
+    ASSERT_TRUE(map.empty());
+    ASSERT_EQ(map.begin(), map.end());
+}
+
+TEST(FlatMapTest, CopiesAreIndependent) {
+    FlatMap<long long, std::string> map;
+    for (long long key = 1; key <= 100; ++key)
+        static_cast<void>(map.insert_or_assign(key, std::to_string(key)));
+
+    auto copy = map;
+    static_cast<void>(copy.insert_or_assign(1, "one"));
+    static_cast<void>(copy.extract(2));
+    ASSERT_EQ(*map.find(1), "1");
+    ASSERT_EQ(*map.find(2), "2");
+    ASSERT_EQ(*copy.find(1), "one");
+    ASSERT_EQ(copy.size(), 99);
+
+    size_t visited = 0;
+    long long sum = 0;
+    for (const auto &[key, value] : map) {
+        visited++;
+        sum += key;
+        ASSERT_EQ(value, std::to_string(key));
+    }
+    ASSERT_EQ(visited, 100);
+    ASSERT_EQ(sum, 5050);
+}
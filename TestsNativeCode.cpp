@@ -0,0 +1,235 @@
+#include <gtest/gtest.h>
+#include "NativeCode.h"
+#include "ProgramBuilder.h"
+
+using namespace project;
+
+static void expect_native_matches_interpreter(Program program) {
+    const auto expected = program.execute();
+    ASSERT_TRUE(program.compile_native());
+    ASSERT_TRUE(program.is_native());
+    ASSERT_EQ(program.execute(), expected);
+}
+
+TEST(NativeCodeTest, ArithmeticMatchesInterpreter) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(1000);
+    const auto accumulator = builder.push(0);
+    const auto real = builder.push(0.25);
+    const auto negative = builder.push(Variant::integer(-3LL));
+    const auto loop = builder.next_instruction_address();
+    builder.add(accumulator, counter);
+    builder.push(3);
+    builder.command(Program::OVERFLOW_MUL);
+    builder.push(1000003);
+    builder.command(Program::OVERFLOW_MOD);
+    builder.assign_from_top(accumulator);
+    builder.mul(real, 1.5);
+    builder.sub(builder.stack_top(), 0.125);
+    builder.assign_from_top(StackAddress(real.offset + 1));
+    builder.pop();
+    builder.add(negative, Variant::integer(-2LL));
+    builder.assign_from_top(negative);
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    builder.add(accumulator, real);
+    builder.add(negative, counter);
+    builder.div(accumulator, 7);
+    builder.swap_top_with(2);
+
+    expect_native_matches_interpreter(builder.build());
+}
+
+TEST(NativeCodeTest, SignedAndFloatingPointConditions) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    BytecodeBuilder builder;
+
+    const auto result = builder.push(0);
+    for (const auto &condition : {Variant::integer(-1LL), Variant::integer(2LL), Variant(-0.5), Variant(0.5),
+        Variant(), Variant::empty_map()}) {
+        builder.push(condition);
+        const auto jump = builder.jump_if_stack_top_positive();
+        builder.add(result, 1);
+        builder.assign_from_top(result);
+        builder.update_jump_location(jump, builder.next_instruction_address());
+        builder.mul(result, 10);
+        builder.assign_from_top(result);
+    }
+
+    expect_native_matches_interpreter(builder.build());
+}
+
+TEST(NativeCodeTest, MapsAndFunctionsCallIntoRuntime) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    BytecodeBuilder builder;
+
+    const auto table = builder.push(Variant::empty_map());
+    const auto square = builder.push(Variant([](const Variant &value) {
+        return value.overflow_mul(value).value();
+    }));
+    for (size_t i = 0; i < 10; ++i) {
+        builder.push(table);
+        builder.push(i);
+        builder.call(square, i);
+        builder.command(Program::SET);
+        builder.assign_from_top(table);
+    }
+    builder.get(table, 7);
+    builder.push(table);
+    builder.push(StackAddress(square.offset + 1));
+    builder.push(1);
+    builder.command(Program::PUSH_GLOBAL);
+    builder.push_unit();
+    builder.push(5);
+    builder.command(Program::OR_ELSE);
+    builder.try_delete(square);
+
+    expect_native_matches_interpreter(builder.build());
+}
+
+TEST(NativeCodeTest, FailingInstructionRethrows) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    BytecodeBuilder builder;
+
+    builder.push(Variant::empty_map());
+    builder.push(4);
+    builder.get(StackAddress(1), 3);
+
+    auto program = builder.build();
+    ASSERT_TRUE(program.compile_native());
+    std::vector<Variant> stack = {Variant(1.5)};
+    ASSERT_THROW(program.execute(stack), ProjectError);
+    ASSERT_EQ(stack.size(), 5);
+    ASSERT_EQ(stack.at(0), Variant(1.5));
+    ASSERT_EQ(stack.at(2), Variant::integer(4));
+}
+
+TEST(NativeCodeTest, UnverifiedProgramKeepsInterpreter) {
+    Program program({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::EQUAL, 0},
+    }, {});
+
+    ASSERT_THROW(program.compile_native(), VerificationError);
+    ASSERT_FALSE(program.is_native());
+    ASSERT_FALSE(program.is_verified());
+}
+
+TEST(NativeCodeTest, CompiledScriptMatchesInterpreter) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let x = 5 in let y = 7 * 8 in let z = x * y + 2.5 in { 1 = x } with { 2 = y } with { 3 = z }";
+    builder.compile(code);
+
+    expect_native_matches_interpreter(builder.build());
+}
+
+TEST(NativeCodeTest, LocalCallsMatchInterpreter) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    expect_native_matches_interpreter(Program({
+        {Program::PUSH_IMMEDIATE, 20},
+        {Program::PUSH_IMMEDIATE, 3},
+        {Program::CALL_LOCAL, Program::local_call(5, 1)},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::RETURN, 0},
+        {Program::PUSH_STACK, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::OVERFLOW_MUL, 0},
+        {Program::RETURN, 1},
+    }, {}));
+    // Counts down more iterations than the call stack holds frames.
+    expect_native_matches_interpreter(Program({
+        {Program::PUSH_CONST, 0},
+        {Program::PUSH_CONST, 1},
+        {Program::CALL_LOCAL, Program::local_call(4, 2)},
+        {Program::RETURN, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::JUMP_IF_POSITIVE, 8},
+        {Program::PUSH_STACK, 0},
+        {Program::RETURN, 2},
+        {Program::PUSH_STACK, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::OVERFLOW_SUB, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::SWAP, 2},
+        {Program::POP, 1},
+        {Program::SWAP, 2},
+        {Program::POP, 1},
+        {Program::TAIL_CALL_LOCAL, Program::local_call(4, 2)},
+    }, {Variant::integer(2 * Program::max_call_depth), Variant::integer(0), Variant::integer(1)}));
+}
+
+TEST(NativeCodeTest, UnboundedRecursionOverflowsCallStack) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    Program program({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+    }, {});
+
+    ASSERT_TRUE(program.compile_native());
+    ASSERT_THROW(program.execute(), ProjectError);
+}
+
+TEST(NativeCodeTest, FailingInstructionInFunctionRethrows) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    Program program({
+        {Program::PUSH_IMMEDIATE, 7},
+        {Program::PUSH_CONST, 0},
+        {Program::CALL_LOCAL, Program::local_call(4, 1)},
+        {Program::RETURN, 1},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::GET, 0},
+        {Program::RETURN, 0},
+    }, {Variant::empty_map()});
+
+    ASSERT_TRUE(program.compile_native());
+    std::vector<Variant> stack;
+    ASSERT_THROW(program.execute(stack), ProjectError);
+    ASSERT_EQ(stack.size(), 3);
+    ASSERT_EQ(stack.at(0), Variant::integer(7));
+    ASSERT_EQ(stack.at(2), Variant::integer(2));
+}
+
+TEST(NativeCodeTest, CompiledFunctionsMatchInterpreter) {
+    if (!PROJECT_NATIVE_CODE)
+        return;
+    for (const auto source : {
+        "let m = input { 1 = 2 , 2 = 3 } in "
+        "let f : x = ( x + 1 + x * x + x * 3 + x * 4 if x else 7 ) in f ( m # 1 ) + f ( m # 2 )",
+        "let m = input { 1 = 10 } in "
+        "let rec f : n acc = ( ( f ( n - 1 ) ) ( acc * n ) if n else acc ) in ( f ( m # 1 ) ) 1",
+        // Deep enough to move the stack while the frames of the callers are on it.
+        "let m = input { 1 = 20000 , 2 = 3 } in let k = m # 2 in "
+        "let rec f : n = ( k + ( f ( n - 1 ) ) if n else 0 ) in ( f ( m # 1 ) ) + ( f 2 )",
+    }) {
+        ProgramBuilder builder;
+        std::stringstream code;
+        code << source;
+        Context context;
+        context.new_symbol("input", builder.new_literal(Literal::function([](const Variant &value) { return value; })));
+        builder.compile(code, context);
+        const auto program = builder.build();
+        ASSERT_TRUE(std::ranges::any_of(program.instructions, [](const auto &instruction) {
+            return instruction.type == Program::CALL_LOCAL;
+        }));
+        expect_native_matches_interpreter(program);
+    }
+}
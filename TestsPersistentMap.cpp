@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+#include "core.h"
+
+using namespace project;
+
+TEST(PersistentMapTest, InsertAndFind) {
+    PersistentMap<long long, int> map;
+    for (long long key = -500; key < 5000; key += 3)
+        ASSERT_TRUE(map.insert_or_assign(key, static_cast<int>(key * 2)));
+    ASSERT_FALSE(map.insert_or_assign(1, 7));
+    ASSERT_TRUE(map.insert_or_assign(std::numeric_limits<long long>::min(), 1));
+
+    ASSERT_EQ(map.size(), 1835);
+    ASSERT_EQ(map.at(-500), -1000);
+    ASSERT_EQ(map.at(1), 7);
+    ASSERT_EQ(map.at(std::numeric_limits<long long>::min()), 1);
+    ASSERT_FALSE(map.contains(0));
+    ASSERT_THROW(static_cast<void>(map.at(2)), std::out_of_range);
+
+    size_t visited = 0;
+    long long sum = 0;
+    for (const auto &[key, value] : map) {
+        visited++;
+        sum += value;
+    }
+    ASSERT_EQ(visited, map.size());
+    ASSERT_EQ(sum, map.at(std::numeric_limits<long long>::min()) + map.at(1) - 2 + [] {
+        long long total = 0;
+        for (long long key = -500; key < 5000; key += 3)
+            total += key * 2;
+        return total;
+    }());
+}
+
+TEST(PersistentMapTest, OlderVersionsDoNotChange) {
+    PersistentMap<long long, int> original;
+    for (long long key = 0; key < 1000; ++key)
+        static_cast<void>(original.insert_or_assign(key, 1));
+
+    auto updated = original;
+    static_cast<void>(updated.insert_or_assign(10, 2));
+    static_cast<void>(updated.insert_or_assign(1000, 3));
+
+    ASSERT_EQ(original.size(), 1000);
+    ASSERT_EQ(original.at(10), 1);
+    ASSERT_FALSE(original.contains(1000));
+    ASSERT_EQ(updated.size(), 1001);
+    ASSERT_EQ(updated.at(10), 2);
+    ASSERT_FALSE(original == updated);
+    static_cast<void>(updated.insert_or_assign(10, 1));
+    ASSERT_FALSE(original == updated);
+    auto rebuilt = PersistentMap<long long, int>();
+    for (long long key = 999; key >= 0; --key)
+        static_cast<void>(rebuilt.insert_or_assign(key, 1));
+    ASSERT_TRUE(original == rebuilt);
+}
+
+TEST(PersistentMapTest, VariantMapsCompareByContent) {
+    auto first = Variant::empty_map();
+    auto second = Variant::empty_map();
+    ASSERT_TRUE(first.set(Variant::integer(1), Variant(2.5)));
+    ASSERT_TRUE(second.set(Variant::integer(1), Variant(2.5)));
+
+    ASSERT_EQ(first, second);
+    ASSERT_TRUE(second.set(Variant::integer(2), Variant()));
+    ASSERT_FALSE(first == second);
+}
+
+TEST(PersistentMapTest, UnsharedChunksAreUpdatedInPlace) {
+    PersistentMap<long long, int> map;
+    for (long long key = 0; key < 2000; ++key)
+        static_cast<void>(map.insert_or_assign(key, 1));
+
+    const auto value = map.find(7);
+    static_cast<void>(map.insert_or_assign(7, 2));
+    ASSERT_EQ(map.find(7), value);
+    ASSERT_EQ(*value, 2);
+
+    const auto copy = map;
+    ASSERT_EQ(copy.find(7), value);
+    static_cast<void>(map.insert_or_assign(7, 3));
+    ASSERT_NE(map.find(7), value);
+    ASSERT_EQ(copy.find(7), value);
+    ASSERT_EQ(copy.at(7), 2);
+    ASSERT_EQ(copy.find(1999), map.find(1999));
+    for (long long key = 0; key < 2000; ++key)
+        static_cast<void>(map.insert_or_assign(key, 4));
+    ASSERT_EQ(map.at(7), 4);
+    ASSERT_EQ(copy.at(1999), 1);
+    ASSERT_EQ(copy.size(), map.size());
+}
+
+TEST(PersistentMapTest, CopiesShareSparseKeys) {
+    PersistentMap<long long, int> map;
+    for (long long key = 1; key < 20000; key += 7)
+        static_cast<void>(map.insert_or_assign(key, 1));
+    ASSERT_EQ(map.dense_size(), 0);
+
+    const auto copy = map;
+    ASSERT_EQ(copy.find(8), map.find(8));
+    static_cast<void>(map.insert_or_assign(8, 2));
+    ASSERT_NE(copy.find(8), map.find(8));
+    ASSERT_EQ(copy.at(8), 1);
+    ASSERT_EQ(map.at(8), 2);
+    // The map owns its keys again, later updates do not copy them.
+    const auto value = map.find(15);
+    static_cast<void>(map.insert_or_assign(15, 3));
+    ASSERT_EQ(map.find(15), value);
+    ASSERT_EQ(copy.at(15), 1);
+    ASSERT_EQ(copy.size(), map.size());
+}
+
+TEST(PersistentMapTest, ContiguousKeysBecomeDense) {
+    PersistentMap<long long, int> map;
+    for (long long key = 999; key >= 1; --key)
+        static_cast<void>(map.insert_or_assign(key, static_cast<int>(key)));
+    static_cast<void>(map.insert_or_assign(-1, -1));
+    ASSERT_EQ(map.dense_size(), 0);
+
+    const auto sparse = map;
+    ASSERT_TRUE(map.insert_or_assign(0, 0));
+    ASSERT_EQ(map.dense_size(), 1000);
+    ASSERT_EQ(map.size(), 1001);
+    ASSERT_FALSE(map.insert_or_assign(500, 7));
+    ASSERT_TRUE(map.insert_or_assign(1000, 1000));
+    ASSERT_EQ(map.dense_size(), 1001);
+    ASSERT_EQ(map.at(500), 7);
+    ASSERT_EQ(map.at(-1), -1);
+    ASSERT_FALSE(map.contains(1001));
+    ASSERT_EQ(sparse.size(), 1000);
+    ASSERT_EQ(sparse.at(500), 500);
+    ASSERT_FALSE(sparse.contains(0));
+
+    long long expected = 0;
+    size_t visited = 0;
+    for (const auto &[key, value] : map) {
+        if (visited++ <= 1000)
+            ASSERT_EQ(key, expected++);
+        else
+            ASSERT_EQ(key, -1);
+    }
+    ASSERT_EQ(visited, map.size());
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "BytecodeBuilder.h"
+#include "Tracer.h"
 
 using namespace project;
 
@@ -87,4 +88,406 @@ TEST(ProgramTest, NewConstant) {
 
     ASSERT_EQ(result.size(), 1);
     ASSERT_EQ(result.at(0), Variant::integer(70));
-}
\ No newline at end of file
+}
+
+TEST(ProgramTest, DispatchEnginesAgree) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(10);
+    builder.push(0);
+    const auto loop = builder.next_instruction_address();
+    builder.add(builder.stack_top(), counter);
+    builder.assign_from_top(StackAddress(1));
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+
+    const Program threaded = builder.build();
+    const Program switched(threaded.instructions, threaded.constants, Program::Dispatch::SWITCH);
+
+    ASSERT_EQ(switched.dispatch, Program::Dispatch::SWITCH);
+    const auto expected = switched.execute();
+    ASSERT_EQ(expected.size(), 2);
+    ASSERT_EQ(expected.at(1), Variant::integer(10 + 9 + 8 + 7 + 6 + 5 + 4 + 3 + 2 + 1));
+    if (PROJECT_COMPUTED_GOTO) {
+        ASSERT_EQ(threaded.dispatch, Program::Dispatch::THREADED);
+        ASSERT_EQ(threaded.execute(), expected);
+    }
+}
+
+TEST(ProgramTest, ThreadedJumpPastEndHalts) {
+    if (!PROJECT_COMPUTED_GOTO)
+        return;
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 3},
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::JUMP_IF_POSITIVE, 100},
+        {Program::PUSH_IMMEDIATE, 4},
+    }, {}, Program::Dispatch::THREADED);
+
+    const auto result = program.execute();
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result.at(0), Variant::integer(3));
+}
+
+TEST(ProgramTest, RingBufferTracerKeepsLastInstructions) {
+    BytecodeBuilder builder;
+
+    builder.push(5);
+    builder.push(3);
+    builder.command(Program::OVERFLOW_MUL);
+    builder.push(2);
+    builder.command(Program::OVERFLOW_ADD);
+
+    const Program built = builder.build();
+    for (const auto dispatch : {Program::Dispatch::SWITCH, Program::default_dispatch}) {
+        const Program program(built.instructions, built.constants, dispatch);
+        RingBufferTracer tracer(3);
+        std::vector<Variant> stack;
+        program.execute(stack, tracer);
+
+        ASSERT_EQ(stack.at(0), Variant::integer(17));
+        ASSERT_EQ(tracer.total_recorded(), 5);
+        const auto entries = tracer.entries();
+        ASSERT_EQ(entries.size(), 3);
+        ASSERT_EQ(entries.at(0).index, 2);
+        ASSERT_EQ(entries.at(0).type, Program::OVERFLOW_MUL);
+        ASSERT_EQ(entries.at(0).stack_depth, 2);
+        ASSERT_EQ(entries.at(1).stack_top, Variant::integer(15));
+        ASSERT_EQ(entries.at(2).type, Program::OVERFLOW_ADD);
+        ASSERT_EQ(entries.at(2).stack_top, Variant::integer(2));
+    }
+}
+
+TEST(ProgramTest, RingBufferTracerDumpsAfterFailure) {
+    BytecodeBuilder builder;
+
+    builder.get(Variant::empty_map(), 4);
+
+    const Program program = builder.build();
+    RingBufferTracer tracer;
+    std::vector<Variant> stack;
+    ASSERT_THROW(program.execute(stack, tracer), ProjectError);
+
+    std::stringstream dump;
+    tracer.dump(dump);
+    ASSERT_EQ(tracer.size(), 3);
+    ASSERT_EQ(tracer.entries().back().type, Program::GET);
+    ASSERT_NE(dump.str().find("#2 op 15"), std::string::npos);
+}
+
+TEST(ProgramTest, VerifyComputesMaxStackDepth) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(4);
+    const auto loop = builder.next_instruction_address();
+    builder.push(counter);
+    builder.push(Variant::integer(7));
+    builder.command(Program::OVERFLOW_MUL);
+    builder.pop();
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+
+    Program program = builder.build();
+    ASSERT_FALSE(program.is_verified());
+    program.verify();
+    ASSERT_TRUE(program.is_verified());
+    ASSERT_EQ(program.verified_stack_depth(), 3);
+
+    const Program copy = program;
+    ASSERT_TRUE(copy.is_verified());
+    const auto result = copy.execute();
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result.at(0), Variant::integer(0));
+    const Program switched(program.instructions, program.constants, Program::Dispatch::SWITCH);
+    ASSERT_EQ(switched.execute(), result);
+}
+
+TEST(ProgramTest, VerifyRejectsInvalidBytecode) {
+    const auto verify = [](std::vector<Program::Instruction> instructions, std::vector<Variant> constants = {}) {
+        Program program(std::move(instructions), std::move(constants));
+        program.verify();
+    };
+
+    ASSERT_NO_THROW(verify({{Program::PUSH_CONST, 0}}, {Variant()}));
+    ASSERT_THROW(verify({{Program::PUSH_CONST, 1}}, {Variant()}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::OVERFLOW_ADD, 0}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::PUSH_STACK, 1}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::SWAP, 1}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::POP, 2}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::JUMP_IF_POSITIVE, 3}}), VerificationError);
+    ASSERT_THROW(verify({{static_cast<Program::InstructionType>(100), 0}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::PUSH_IMMEDIATE, 1}, {Program::EQUAL, 0}}),
+        VerificationError);
+    // The jump skips a push, so both paths reach the end with different depths.
+    ASSERT_THROW(verify({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::JUMP_IF_POSITIVE, 3},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::PUSH_IMMEDIATE, 3},
+    }), VerificationError);
+}
+
+TEST(VariantTest, CompactRepresentation) {
+    ASSERT_EQ(sizeof(Variant), 16);
+    ASSERT_TRUE(Variant::integer(5).is_inlined());
+    ASSERT_TRUE(Variant::floating_point(0.5).is_inlined());
+    ASSERT_TRUE(Variant().is_inlined());
+    ASSERT_FALSE(Variant::empty_map().is_inlined());
+    ASSERT_EQ(Variant::integer(-5).type(), Variant::Type::SIGNED);
+    ASSERT_EQ(Variant::integer(5u).type(), Variant::Type::UNSIGNED);
+    ASSERT_EQ(Variant().type(), Variant::Type::UNIT);
+}
+
+TEST(VariantTest, CopiesShareMapUntilWritten) {
+    auto original = Variant::empty_map();
+    ASSERT_TRUE(original.set(Variant::integer(1), Variant::integer(10)));
+
+    auto copy = original;
+    ASSERT_EQ(copy, original);
+    ASSERT_TRUE(copy.set(Variant::integer(1), Variant::integer(20)));
+    ASSERT_TRUE(copy.set(Variant::integer(2), Variant::integer(30)));
+
+    ASSERT_EQ(original.get(Variant::integer(1)), Variant::integer(10));
+    ASSERT_FALSE(original.get(Variant::integer(2)).has_value());
+    ASSERT_EQ(copy.get(Variant::integer(1)), Variant::integer(20));
+    ASSERT_EQ(copy.get(Variant::integer(2)), Variant::integer(30));
+}
+
+TEST(VariantTest, MoveLeavesUnitAndFunctionCopiesCompareEqual) {
+    auto function = Variant([](const Variant &value) { return value; });
+    auto copy = function;
+    ASSERT_EQ(copy, function);
+    ASSERT_FALSE(Variant([](const Variant &value) { return value; }) == function);
+
+    auto moved = std::move(function);
+    ASSERT_EQ(function.type(), Variant::Type::UNIT);
+    std::vector arguments = {Variant::integer(3)};
+    ASSERT_EQ(moved.call(arguments), Variant::integer(3));
+}
+
+TEST(VariantTest, NativeFunctionTakesAllArgumentsAtOnce) {
+    size_t calls = 0;
+    const Program program({
+        {Program::PUSH_CONST, 0},
+        {Program::PUSH_CONST, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::PUSH_CONST, 3},
+        {Program::CALL, 3},
+        {Program::PUSH_CONST, 0},
+        {Program::PUSH_CONST, 3},
+        {Program::CALL, 1},
+        {Program::PUSH_CONST, 1},
+        {Program::SWAP, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::SWAP, 1},
+        {Program::CALL, 2},
+        {Program::OVERFLOW_ADD, 0},
+    }, {
+        Variant::integer(7),
+        Variant::floating_point(0.5),
+        Variant::integer(-2),
+        Variant::native<double(long long, double, const Variant&)>([&](long long a, double b, const Variant &c) {
+            ++calls;
+            return static_cast<double>(a) * b + static_cast<double>(c.try_to_index().has_value());
+        }),
+    });
+
+    ASSERT_EQ(program.run(), Variant::floating_point(9.0));
+    ASSERT_EQ(calls, 2);
+    auto function = Variant::native<long long(long long)>([](long long value) { return value; });
+    std::vector arguments = {Variant::empty_map()};
+    ASSERT_THROW(function.call(arguments), ProjectError);
+}
+
+TEST(ProgramTest, QuickenedArithmeticFollowsOperandTypes) {
+    const Program program({
+        {Program::PUSH_STACK, 1},
+        {Program::PUSH_STACK, 1},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::PUSH_STACK, 2},
+        {Program::OVERFLOW_MUL, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::OVERFLOW_SUB, 0},
+    }, {});
+    const auto run = [&](Variant first, Variant second) {
+        std::vector stack = {std::move(first), std::move(second)};
+        program.execute(stack);
+        return stack.back();
+    };
+
+    ASSERT_EQ(run(Variant::integer(-2), Variant::integer(5)), Variant::integer(3 * -2 - 5));
+    ASSERT_EQ(run(Variant::integer(-2), Variant::integer(5)).type(), Variant::Type::SIGNED);
+    ASSERT_EQ(run(Variant::floating_point(0.5), Variant::floating_point(2.0)), Variant::floating_point(2.5 * 0.5 - 2.0));
+    ASSERT_EQ(run(Variant::integer(4u), Variant::integer(2u)), Variant::integer(6 * 4 - 2));
+    ASSERT_EQ(run(Variant::integer(4u), Variant::integer(2u)).type(), Variant::Type::UNSIGNED);
+    ASSERT_EQ(run(Variant::integer(4u), Variant::floating_point(0.5)), Variant::floating_point(4.5 * 4 - 0.5));
+    ASSERT_EQ(run(Variant::integer(-2), Variant::integer(5)), Variant::integer(3 * -2 - 5));
+    ASSERT_THROW(run(Variant(), Variant::integer(5)), std::bad_optional_access);
+}
+
+TEST(ProgramTest, SuperinstructionsAgreeWithSwitchDispatch) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(20);
+    const auto table = builder.push(Variant::empty_map());
+    const auto loop = builder.next_instruction_address();
+    builder.push(table);
+    builder.stack_top_set(counter, Variant::floating_point(0.5));
+    builder.assign_from_top(table);
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+    builder.add(counter, 7);
+    const auto skip = builder.unconditional_jump();
+    builder.push(100);
+    builder.pop();
+    builder.update_jump_location(skip, builder.next_instruction_address());
+
+    Program threaded = builder.build();
+    const Program switched(threaded.instructions, threaded.constants, Program::Dispatch::SWITCH);
+    const auto expected = switched.execute();
+    ASSERT_EQ(expected.size(), 3);
+    ASSERT_EQ(expected.at(2), Variant::integer(7));
+    ASSERT_EQ(expected.at(1).get(Variant::integer(20)), Variant::floating_point(0.5));
+    if (!PROJECT_COMPUTED_GOTO)
+        return;
+    // build() dropped the skipped code together with the jump over it.
+    ASSERT_EQ(threaded.superinstruction_count(), 5);
+    ASSERT_EQ(threaded.execute(), expected);
+    threaded.verify();
+    ASSERT_EQ(threaded.superinstruction_count(), 5);
+    ASSERT_EQ(threaded.execute(), expected);
+}
+
+TEST(ProgramTest, SuperinstructionsAreNotFusedAcrossJumpTargets) {
+    if (!PROJECT_COMPUTED_GOTO)
+        return;
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 5},
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::JUMP_IF_POSITIVE, 4},
+        {Program::PUSH_STACK, 0},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::OVERFLOW_ADD, 0},
+    }, {}, Program::Dispatch::THREADED);
+
+    ASSERT_EQ(program.superinstruction_count(), 1);
+    const auto result = program.execute();
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result.at(0), Variant::integer(7));
+}
+
+TEST(ProgramTest, LocalCallsReturnToCaller) {
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 20},
+        {Program::PUSH_IMMEDIATE, 3},
+        {Program::CALL_LOCAL, Program::local_call(5, 1)},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::RETURN, 0},
+        {Program::PUSH_STACK, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::OVERFLOW_MUL, 0},
+        {Program::RETURN, 1},
+    }, {});
+
+    Program verified = program;
+    verified.verify();
+    ASSERT_EQ(verified.verified_functions().at(2), 0);
+    ASSERT_EQ(verified.verified_functions().at(7), 5);
+    const Program switched(program.instructions, program.constants, Program::Dispatch::SWITCH);
+    const auto result = switched.execute();
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result.at(0), Variant::integer(29));
+    ASSERT_EQ(program.execute(), result);
+}
+
+TEST(ProgramTest, UnboundedRecursionOverflowsCallStack) {
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(2, 1)},
+        {Program::CALL_LOCAL, Program::local_call(2, 1)},
+        {Program::RETURN, 0},
+    }, {});
+    const Program switched(program.instructions, program.constants, Program::Dispatch::SWITCH);
+
+    ASSERT_THROW(switched.execute(), ProjectError);
+    ASSERT_THROW(program.execute(), ProjectError);
+}
+
+TEST(ProgramTest, TailCallsReuseTheFrame) {
+    // Counts down more iterations than the call stack holds frames.
+    const Program program({
+        {Program::PUSH_CONST, 0},
+        {Program::PUSH_CONST, 1},
+        {Program::CALL_LOCAL, Program::local_call(4, 2)},
+        {Program::RETURN, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::JUMP_IF_POSITIVE, 8},
+        {Program::PUSH_STACK, 0},
+        {Program::RETURN, 2},
+        {Program::PUSH_STACK, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::OVERFLOW_SUB, 0},
+        {Program::PUSH_STACK, 1},
+        {Program::PUSH_CONST, 2},
+        {Program::OVERFLOW_ADD, 0},
+        {Program::SWAP, 2},
+        {Program::POP, 1},
+        {Program::SWAP, 2},
+        {Program::POP, 1},
+        {Program::TAIL_CALL_LOCAL, Program::local_call(4, 2)},
+    }, {Variant::integer(2 * Program::max_call_depth), Variant::integer(0), Variant::integer(1)});
+
+    Program verified = program;
+    verified.verify();
+    ASSERT_EQ(verified.verified_functions().at(18), 4);
+    const Program switched(program.instructions, program.constants, Program::Dispatch::SWITCH);
+    ASSERT_EQ(switched.run(), Variant::integer(2 * Program::max_call_depth));
+    ASSERT_EQ(program.run(), Variant::integer(2 * Program::max_call_depth));
+}
+
+TEST(ProgramTest, VerifyRejectsInvalidFunctions) {
+    const auto verify = [](std::vector<Program::Instruction> instructions) {
+        Program program(std::move(instructions), {});
+        program.verify();
+    };
+
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::CALL_LOCAL, Program::local_call(0, 1)}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::CALL_LOCAL, Program::local_call(2, 1)}}), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::RETURN, 0}, {Program::PUSH_IMMEDIATE, 2}}), VerificationError);
+    // The function leaves its argument below the result.
+    ASSERT_THROW(verify({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::RETURN, 0},
+    }), VerificationError);
+    // The function runs off the end of the program.
+    ASSERT_THROW(verify({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+        {Program::PUSH_IMMEDIATE, 2},
+    }), VerificationError);
+    // The main code jumps into the body of the function.
+    ASSERT_THROW(verify({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(5, 1)},
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::JUMP_IF_POSITIVE, 5},
+        {Program::RETURN, 0},
+        {Program::RETURN, 0},
+    }), VerificationError);
+    ASSERT_THROW(verify({{Program::PUSH_IMMEDIATE, 1}, {Program::TAIL_CALL_LOCAL, Program::local_call(0, 1)}}), VerificationError);
+    // The tail call keeps a value of the frame below its argument.
+    ASSERT_THROW(verify({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::TAIL_CALL_LOCAL, Program::local_call(3, 1)},
+    }), VerificationError);
+}
@@ -29,6 +29,110 @@ TEST(ProgramBuilderTest, WriteToFile) {
     ASSERT_EQ(value, "12");
 }
 
+TEST(ProgramBuilderTest, NativeFunctionIsCalledWithAllArguments) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 15 } in ( ( clamp ( m # 1 ) ) 0 ) 10";
+    Context context;
+    context.new_symbol("clamp", builder.new_literal(
+        Literal::native<long long(long long, long long, long long)>(
+            [](long long value, long long low, long long high) {
+                return std::clamp(value, low, high);
+            }
+    )));
+    builder.compile(code, context);
+    auto program = builder.build();
+    const auto call = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::CALL;
+    });
+    ASSERT_NE(call, program.instructions.end());
+    ASSERT_EQ(call->argument, 3);
+    ASSERT_EQ(program.run(), Variant::integer(10));
+}
+
+TEST(ProgramBuilderTest, PureFunctionOfKnownArgumentsIsFolded) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 4 } in ( ( clamp 15 ) 0 ) 10 + square 3 + square ( m # 1 )";
+    Context context;
+    context.new_symbol("input", builder.new_literal(Literal::function([](const Variant &value) { return value; })));
+    size_t calls = 0;
+    context.new_symbol("clamp", builder.new_literal(
+        Literal::native<long long(long long, long long, long long)>(
+            [&](long long value, long long low, long long high) {
+                ++calls;
+                return std::clamp(value, low, high);
+            },
+        true
+    )));
+    context.new_symbol("square", builder.new_literal(
+        Literal::function(
+            [&](const Variant &value) {
+                ++calls;
+                return value.overflow_mul(value).value();
+            },
+        true
+    )));
+    builder.compile(code, context);
+    ASSERT_EQ(calls, 2);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::CALL;
+    }), 2);
+    ASSERT_EQ(program.run(), Variant::integer(10 + 9 + 16));
+    ASSERT_EQ(calls, 3);
+}
+
+TEST(ProgramBuilderTest, FailingPureCallFailsWhenTheProgramRuns) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "( ( increment ( () ) ) if ( input 0 ) else 1 ) + ( let unused = increment ( () ) in 4 )";
+    Context context;
+    context.new_symbol("input", builder.new_literal(Literal::function([](const Variant &value) { return value; })));
+    context.new_symbol("increment", builder.new_literal(
+        Literal::native<long long(long long)>([](long long value) { return value + 1; }, true)
+    ));
+    builder.compile(code, context);
+    ASSERT_EQ(builder.build().run(), Variant::integer(5));
+}
+
+TEST(ProgramBuilderTest, FunctionReturnedByPureCallIsNotFolded) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let g = ( make 5 ) in ( g 1 ) + ( g 2 )";
+    Context context;
+    size_t ticks = 0;
+    context.new_symbol("make", builder.new_literal(
+        Literal::function(
+            [&](const Variant &k) {
+                return Variant([&ticks, k](const Variant &value) {
+                    ++ticks;
+                    return value.overflow_add(k).value();
+                });
+            },
+        true
+    )));
+    builder.compile(code, context);
+    ASSERT_EQ(ticks, 0);
+    ASSERT_EQ(builder.build().run(), Variant::integer(13));
+    ASSERT_EQ(ticks, 2);
+}
+
+TEST(ProgramBuilderTest, CompiledBranchesVerify) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 0 } in "
+            "( m # 1 + 1 if m # 2 else ( m # 1 * 3 if m # 1 else 0 ) ) + ( 5 if m # 1 else 7 )";
+    Context context;
+    context.new_symbol("input", builder.new_literal(Literal::function([](const Variant &value) { return value; })));
+    builder.compile(code, context);
+    auto program = builder.build();
+    const auto expected = program.execute();
+    ASSERT_NO_THROW(program.verify());
+    ASSERT_EQ(program.execute(), expected);
+    ASSERT_EQ(expected.at(0), Variant::integer(6 + 5));
+}
+
 TEST(ProgramBuilderTest, ReadFromFile) {
     auto name = "read_test.txt";
     std::ifstream read(name);
@@ -3,6 +3,13 @@
 
 using namespace project;
 
+/// Context with a function input returning its argument, its result is not known while compiling.
+static Context input_context(ProgramBuilder &builder) {
+    Context context;
+    context.new_symbol("input", builder.new_literal(Literal::function([](const Variant &value) { return value; })));
+    return context;
+}
+
 TEST(SymbolTest, LiteralOverflowSubtraction) {
     ProgramBuilder builder;
     auto five = Literal::integer(5);
@@ -70,4 +77,324 @@ TEST(SymbolTest, AstFieldOfMap) {
     result.define(builder);
     ASSERT_EQ(builder.build().run(), Variant::integer(1));
     ASSERT_EQ(Variant::integer(1).try_to_index(), 1);
-}
\ No newline at end of file
+}
+TEST(SymbolTest, UpdateMovesMapNotReadByNewValues) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let a = 5 in let m = input { 1 = 2 } in m with { 3 = a }";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    ASSERT_TRUE(std::ranges::any_of(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::DELETE;
+    }));
+    ASSERT_EQ(program.run().get(Variant::integer(3)), Variant::integer(5));
+}
+
+TEST(SymbolTest, UpdateKeepsMapReadLater) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 2 } in let n = m with { 1 = 3 } in m # 1 * 10 + n # 1";
+    auto ast = builder.compile_expression(code);
+    auto context = Context();
+    ast->create_symbols(builder, context).define(builder);
+    ASSERT_EQ(builder.build().run(), Variant::integer(23));
+}
+
+TEST(SymbolTest, DeadMapIsDeletedAfterLastUse) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in let a = m # 2 in let b = a * 4 in b + a";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    const auto get = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::GET;
+    });
+    const auto deleted = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::DELETE;
+    });
+    ASSERT_NE(deleted, program.instructions.end());
+    ASSERT_LT(deleted, get);
+    ASSERT_EQ(program.run(), Variant::integer(15));
+}
+
+TEST(SymbolTest, FunctionCalledTwiceIsCompiledOnce) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in "
+            "let f : x = ( x + 1 + x * x + x * 3 + x * 4 if x else 7 ) in f ( m # 1 ) + f ( m # 2 )";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::CALL_LOCAL;
+    }), 2);
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::RETURN;
+    }), 1);
+    ASSERT_EQ(program.run(), Variant::integer(21 + 34));
+}
+
+TEST(SymbolTest, ValueConsumedByConditionIsPushedAgainInBranch) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "( 1 if ( input 4 ) else ( input 3 ) ) + ( 1 if ( input 0 ) else ( input 3 ) )";
+    auto context = input_context(builder);
+    builder.compile(code, context);
+    auto program = builder.build();
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(4));
+}
+
+TEST(SymbolTest, LaterCallsDoNotBuildTheBodyAgain) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in "
+            "let f : x = x * x + x * 3 + x * ( square 4 ) + 5 in f ( m # 1 ) + f ( m # 2 ) + f ( m # 1 + 1 )";
+    auto context = input_context(builder);
+    size_t calls = 0;
+    context.new_symbol("square", builder.new_literal(Literal::function([&](const Variant &value) {
+        ++calls;
+        return value.overflow_mul(value).value();
+    }, true)));
+    builder.compile(code, context);
+    // The first call builds the body inline, then out of line passing m and again without it.
+    ASSERT_EQ(calls, 3);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::CALL_LOCAL;
+    }), 3);
+    ASSERT_EQ(program.run(), Variant::integer(4 + 6 + 32 + 5 + 9 + 9 + 48 + 5 + 9 + 9 + 48 + 5));
+}
+
+TEST(SymbolTest, CapturedValuesArePassedToFunction) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in let a = m # 1 in let b = m # 2 in "
+            "let f : x = a * x * x + a * x + a * 3 + x * 5 + 4 in f b + f a";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    const auto call = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::CALL_LOCAL;
+    });
+    ASSERT_NE(call, program.instructions.end());
+    ASSERT_EQ(Program::call_arguments(call->argument), 2);
+    ASSERT_EQ(program.run(), Variant::integer(18 + 6 + 6 + 15 + 4 + 8 + 4 + 6 + 10 + 4));
+}
+
+TEST(SymbolTest, RecursiveFunctionTailCallsItself) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 10 } in "
+            "let rec f : n acc = ( ( f ( n - 1 ) ) ( acc * n ) if n else acc ) in ( f ( m # 1 ) ) 1";
+    auto ast = builder.compile_expression(code);
+    auto context = Context();
+    ast->create_symbols(builder, context).define(builder);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::TAIL_CALL_LOCAL;
+    }), 1);
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(3628800));
+}
+
+TEST(SymbolTest, RecursiveFunctionPassesCapturedValues) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 10 , 2 = 3 } in let k = m # 2 in "
+            "let rec f : n = ( k + ( f ( n - 1 ) ) if n else 0 ) in ( f ( m # 1 ) ) + ( f 2 )";
+    auto ast = builder.compile_expression(code);
+    auto context = Context();
+    ast->create_symbols(builder, context).define(builder);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::RETURN;
+    }), 1);
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(36));
+}
+
+TEST(SymbolTest, ErrorInRecursiveFunctionBodyIsReported) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "1 + ( let rec f : x = ( ( f ( x - 1 ) ) if x else y ) in ( f 3 ) )";
+    ASSERT_THROW(builder.compile(code), UndefinedSymbol);
+}
+
+TEST(SymbolTest, RepeatedOperationIsComputedOnce) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in let x = m # 1 in let y = m # 2 in let a = x * y + 1 in ( x * y ) * a";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::OVERFLOW_MUL;
+    }), 2);
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(42));
+}
+
+TEST(SymbolTest, ValueReadInBranchesIsComputedOncePerBranch) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 3 } in let x = m # 1 in "
+            "( x * 5 + x * 5 if m # 2 else x * 5 ) + ( let f : v = v * v + v in f ( m # 2 ) )";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::OVERFLOW_MUL;
+    }), 3);
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(20 + 12));
+}
+
+TEST(SymbolTest, CapturedValueReadOnlyByInlinedCallsIsNotShared) {
+    for (const auto &[source, expected] : {
+        std::pair{"( let v1 = ( input 1 ) in ( let f22 : p23 = ( let f25 : p26 p27 = 2 in "
+            "( ( f25 v1 ) ( v1 + 1 ) ) ) in ( f22 1 ) ) )", 2ll},
+        std::pair{"( let f1 : p2 p3 = ( let f4 : p5 = ( let f6 : p7 p8 = 1 in ( let v13 = "
+            "{ 3 = 1 , 2 = ( ( f6 p3 ) p3 ) , 1 = 1 } in v13 ) ) in ( ( f4 3 ) # 3 ) ) in ( ( f1 1 ) 1 ) )", 1ll},
+    }) {
+        ProgramBuilder builder;
+        std::stringstream code;
+        code << source;
+        auto context = input_context(builder);
+        builder.compile(code, context);
+        auto program = builder.build();
+        program.verify();
+        ASSERT_EQ(program.run(), Variant::integer(expected));
+    }
+}
+
+TEST(SymbolTest, UnreadBindingIsNotDefined) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 } in let x = m # 1 in let unused = x * 1000 in "
+            "let f : v = v * x in let g : v = v * unused in f 3";
+    auto context = input_context(builder);
+    builder.compile(code, context);
+    auto program = builder.build();
+    ASSERT_EQ(std::ranges::count_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::OVERFLOW_MUL;
+    }), 1);
+    ASSERT_EQ(program.run(), Variant::integer(6));
+}
+
+TEST(SymbolTest, LetChainReusesReleasedSlots) {
+    for (const auto length : {2, 16}) {
+        ProgramBuilder builder;
+        std::stringstream code;
+        code << "let m = input { 1 = 1 } in let v0 = m # 1 in ";
+        for (auto i = 1; i <= length; ++i)
+            code << "let v" << i << " = v" << i - 1 << " * 2 + v0 in ";
+        code << 'v' << length;
+        auto context = input_context(builder);
+        builder.compile(code, context);
+        auto program = builder.build();
+        program.verify();
+        ASSERT_EQ(program.verified_stack_depth(), 5);
+        ASSERT_EQ(program.run(), Variant::integer((1ll << (length + 1)) - 1));
+    }
+}
+
+TEST(SymbolTest, UnreadBindingWithEffectsIsDefined) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 2 } in let unused = log ( m # 1 ) in m # 1";
+    Context context;
+    size_t calls = 0;
+    context.new_symbol("log", builder.new_literal(Literal::function([&](const Variant &value) {
+        ++calls;
+        return value;
+    })));
+    builder.compile(code, context);
+    ASSERT_EQ(builder.build().run(), Variant::integer(2));
+    ASSERT_EQ(calls, 1);
+}
+
+TEST(SymbolTest, UpdateOfKnownMapIsOneConstant) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let a = 5 in let m = { 1 = 2 } in m with { 3 = a }";
+    auto ast = builder.compile_expression(code);
+    auto context = Context();
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    ASSERT_EQ(program.instructions.size(), 1);
+    ASSERT_EQ(program.instructions.front().type, Program::PUSH_CONST);
+    ASSERT_EQ(program.run().get(Variant::integer(3)), Variant::integer(5));
+}
+
+TEST(SymbolTest, UpdateMovesMapReadFromAnotherMap) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let a = 5 in let s = input { 1 = { 1 = 2 } } in let m = s # 1 in let n = m with { 3 = a } in n";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    const auto program = builder.build();
+    ASSERT_TRUE(std::ranges::any_of(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::DELETE;
+    }));
+    ASSERT_EQ(program.run().get(Variant::integer(3)), Variant::integer(5));
+}
+
+TEST(SymbolTest, ErrorOfUnreadBindingDoesNotSurface) {
+    // A failing GET is not an effect, the unread binding is dropped with its error.
+    ProgramBuilder builder;
+    std::stringstream unread;
+    unread << "let m = input { 1 = 2 } in let missing = m # 5 in m # 1";
+    auto context = input_context(builder);
+    builder.compile(unread, context);
+    ASSERT_EQ(builder.build().run(), Variant::integer(2));
+
+    ProgramBuilder read_builder;
+    std::stringstream read;
+    read << "let m = input { 1 = 2 } in let missing = m # 5 in missing";
+    auto read_context = input_context(read_builder);
+    read_builder.compile(read, read_context);
+    ASSERT_THROW(read_builder.build().run(), ProjectError);
+}
+
+TEST(SymbolTest, BindingReadInOneBranchIsDefinedThere) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = input { 1 = 2 , 2 = 0 } in let x = m # 1 in let y = x * 3 in ( y + y if m # 2 else 7 )";
+    auto ast = builder.compile_expression(code);
+    auto context = input_context(builder);
+    ast->create_symbols(builder, context).define(builder);
+    auto program = builder.build();
+    const auto branch = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::JUMP_IF_POSITIVE;
+    });
+    const auto multiplication = std::ranges::find_if(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::OVERFLOW_MUL;
+    });
+    ASSERT_LT(branch, multiplication);
+    program.verify();
+    ASSERT_EQ(program.run(), Variant::integer(7));
+}
+
+TEST(SymbolTest, KnownValuesAreFoldedWhileCompiling) {
+    ProgramBuilder builder;
+    std::stringstream code;
+    code << "let m = { 1 = 2 , 2 = { 1 = 5 } } in "
+            "let n = ( m # 2 ) with { 2 = m # 1 } in ( n # 1 * 10 + n # 2 if m # 1 else 0 )";
+    builder.compile(code);
+    auto program = builder.build();
+    ASSERT_TRUE(std::ranges::none_of(program.instructions, [](const auto &instruction) {
+        return instruction.type == Program::JUMP_IF_POSITIVE || instruction.type == Program::GET
+            || instruction.type == Program::SET;
+    }));
+    ASSERT_EQ(program.run(), Variant::integer(52));
+}
@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+#include "BytecodeBuilder.h"
+#include "Transpiler.h"
+
+using namespace project;
+
+TEST(TranspilerTest, StackSlotsBecomeLocals) {
+    BytecodeBuilder builder;
+
+    const auto counter = builder.push(10);
+    const auto total = builder.push(1.5);
+    builder.push(Variant::empty_map());
+    const auto loop = builder.next_instruction_address();
+    builder.add(total, counter);
+    builder.assign_from_top(total);
+    builder.sub(counter, 1);
+    builder.assign_from_top(counter);
+    builder.update_jump_location(builder.jump_if_positive(counter), loop);
+
+    std::stringstream source;
+    transpile(builder.build(), "script", source);
+    const auto text = source.str();
+
+    ASSERT_NE(text.find("extern \"C\" void script(std::vector<project::Variant>& stack,"), std::string::npos);
+    ASSERT_NE(text.find("Variant s0, s1, s2, s3, s4;"), std::string::npos);
+    ASSERT_NE(text.find("s1 = Variant(0x1.8p+0);"), std::string::npos);
+    ASSERT_NE(text.find("s2 = constants[1];"), std::string::npos);
+    ASSERT_NE(text.find("i3:\n"), std::string::npos);
+    ASSERT_NE(text.find("s3 = Runtime::add(s3, s4);"), std::string::npos);
+    ASSERT_NE(text.find("goto i3;"), std::string::npos);
+    ASSERT_NE(text.find("stack.push_back(std::move(s2));"), std::string::npos);
+    ASSERT_EQ(text.find("stack.push_back(std::move(s3));"), std::string::npos);
+}
+
+TEST(TranspilerTest, SelfTailCallRestartsFunction) {
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 3},
+        {Program::CALL_LOCAL, Program::local_call(3, 1)},
+        {Program::RETURN, 0},
+        {Program::PUSH_STACK, 0},
+        {Program::JUMP_IF_POSITIVE, 6},
+        {Program::RETURN, 0},
+        {Program::PUSH_IMMEDIATE, 0},
+        {Program::SWAP, 1},
+        {Program::POP, 1},
+        {Program::TAIL_CALL_LOCAL, Program::local_call(3, 1)},
+    }, {});
+
+    std::stringstream source;
+    transpile(program, "countdown", source);
+    const auto text = source.str();
+
+    ASSERT_NE(text.find("static project::Variant function3("), std::string::npos);
+    ASSERT_NE(text.find("i3:\n"), std::string::npos);
+    ASSERT_NE(text.find("goto i3;"), std::string::npos);
+}
+
+TEST(TranspilerTest, UnimplementedInstructionIsRejected) {
+    const Program program({
+        {Program::PUSH_IMMEDIATE, 1},
+        {Program::PUSH_IMMEDIATE, 2},
+        {Program::EQUAL, 0},
+    }, {});
+
+    std::stringstream source;
+    ASSERT_THROW(transpile(program, "equal", source), VerificationError);
+}
+
+TEST(TranspilerTest, RejectsInvalidBytecode) {
+    const Program program({{Program::POP, 1}}, {});
+
+    std::stringstream source;
+    ASSERT_THROW(transpile(program, "invalid", source), VerificationError);
+}
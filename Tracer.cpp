@@ -0,0 +1,49 @@
+#include "Tracer.h"
+
+#include <stdexcept>
+
+using namespace project;
+
+RingBufferTracer::RingBufferTracer(const size_t capacity)
+    : buffer(capacity)
+{
+    if (capacity == 0)
+        throw std::invalid_argument("RingBufferTracer capacity must be positive");
+}
+
+void RingBufferTracer::record(const size_t index, const Program::Instruction &instruction,
+    const std::vector<Variant> &stack) {
+    auto &entry = buffer[recorded % buffer.size()];
+    entry.index = index;
+    entry.type = instruction.type;
+    entry.argument = instruction.argument;
+    entry.stack_depth = stack.size();
+    if (stack.empty())
+        entry.stack_top.reset();
+    else
+        entry.stack_top = stack.back();
+    recorded++;
+}
+
+std::vector<RingBufferTracer::Entry> RingBufferTracer::entries() const {
+    std::vector<Entry> result;
+    result.reserve(size());
+    for (size_t i = recorded - size(); i < recorded; ++i)
+        result.push_back(buffer[i % buffer.size()]);
+    return result;
+}
+
+void RingBufferTracer::dump(std::ostream &stream) const {
+    for (const auto &entry : entries())
+        stream << entry << '\n';
+}
+
+std::ostream & project::operator<<(std::ostream &stream, const RingBufferTracer::Entry &entry) {
+    stream << '#' << entry.index << " op " << entry.type << ' ' << entry.argument
+        << " depth " << entry.stack_depth << " top ";
+    if (entry.stack_top.has_value())
+        stream << entry.stack_top.value();
+    else
+        stream << "<empty>";
+    return stream;
+}
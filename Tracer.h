@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Program.h"
+
+namespace project {
+
+    /// Tracer used by Program::execute(stack). Every call to it is discarded at compile time.
+    struct NullTracer {
+        static constexpr bool enabled = false;
+
+        void record(size_t, const Program::Instruction&, const std::vector<Variant>&) {}
+    };
+
+    /// Opt-in tracer passed to Program::execute(stack, tracer), called before every instruction.
+    struct Tracer {
+        static constexpr bool enabled = true;
+
+        virtual ~Tracer() = default;
+        virtual void record(size_t index, const Program::Instruction& instruction, const std::vector<Variant>& stack) = 0;
+    };
+
+    /// Keeps the last capacity() executed instructions, so they can be dumped after a failure.
+    class RingBufferTracer final : public Tracer {
+    public:
+        struct Entry {
+            size_t index;
+            Program::InstructionType type;
+            Program::word argument;
+            size_t stack_depth;
+            std::optional<Variant> stack_top;
+
+            friend std::ostream& operator<<(std::ostream& stream, const Entry& entry);
+        };
+
+        explicit RingBufferTracer(size_t capacity = 64);
+
+        void record(size_t index, const Program::Instruction& instruction, const std::vector<Variant>& stack) override;
+
+        [[nodiscard]] size_t capacity() const { return buffer.size(); }
+        [[nodiscard]] size_t size() const { return std::min(recorded, buffer.size()); }
+        [[nodiscard]] size_t total_recorded() const { return recorded; }
+        /// Recorded entries, oldest first.
+        [[nodiscard]] std::vector<Entry> entries() const;
+        void dump(std::ostream& stream) const;
+        void clear() { recorded = 0; }
+
+    private:
+        std::vector<Entry> buffer;
+        size_t recorded = 0;
+    };
+
+    std::ostream& operator<<(std::ostream& stream, const RingBufferTracer::Entry& entry);
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <stdexcept>
+
+#include "core.h"
+
+namespace project {
+
+    /// Operations used by the C++ source written by transpile(). Numbers of the same type
+    /// are handled inline, everything else calls into the Variant runtime.
+    struct TranspiledRuntime {
+        static Variant add(const Variant& first, const Variant& second)
+            { return arithmetic<std::plus<>>(first, second, &Variant::overflow_add); }
+        static Variant sub(const Variant& first, const Variant& second)
+            { return arithmetic<std::minus<>>(first, second, &Variant::overflow_sub); }
+        static Variant mul(const Variant& first, const Variant& second)
+            { return arithmetic<std::multiplies<>>(first, second, &Variant::overflow_mul); }
+
+        static bool jumps(const Variant& value) {
+            switch (value.tag) {
+                case Variant::Type::UNSIGNED: return value.payload > 0;
+                case Variant::Type::SIGNED: return std::bit_cast<long long>(value.payload) > 0;
+                case Variant::Type::FLOATING_POINT: return std::bit_cast<double>(value.payload) > 0;
+                default: return false;
+            }
+        }
+
+        static Variant get(const Variant& value, const Variant& index) {
+            auto result = value.get(index);
+            if (result.has_value() == false)
+                throw ProjectError("cannot get index");
+            return std::move(result.value());
+        }
+
+        static void set(Variant& object, const Variant& index, Variant value) {
+            if (object.set(index, std::move(value)) == false)
+                throw ProjectError("cannot set index to value");
+        }
+
+        static Variant call(Variant callable, const std::span<Variant> arguments) {
+            if (arguments.empty())
+                throw std::out_of_range("Program::curry: argument count out of range");
+            return callable.call(arguments);
+        }
+
+        /// Value index places below the values of the transpiled program on the stack.
+        static Variant global(const std::vector<Variant>& stack, const size_t index) {
+            if (index >= stack.size())
+                throw std::out_of_range("Program::push_global: index out of range");
+            return stack[stack.size() - index - 1];
+        }
+
+    private:
+        template<class OPERATION>
+        static Variant arithmetic(const Variant& first, const Variant& second,
+            std::optional<Variant> (Variant::*generic)(const Variant&) const) {
+            if (first.tag == second.tag) {
+                Variant result;
+                result.tag = first.tag;
+                if (first.tag == Variant::Type::UNSIGNED || first.tag == Variant::Type::SIGNED) {
+                    result.payload = OPERATION{}(first.payload, second.payload);
+                    return result;
+                }
+                if (first.tag == Variant::Type::FLOATING_POINT) {
+                    result.payload = std::bit_cast<std::uint64_t>(
+                        OPERATION{}(std::bit_cast<double>(first.payload), std::bit_cast<double>(second.payload)));
+                    return result;
+                }
+            }
+            return (first.*generic)(second).value();
+        }
+    };
+
+}
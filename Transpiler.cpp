@@ -0,0 +1,256 @@
+#include "Transpiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <dlfcn.h>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+using namespace project;
+
+static std::string slot(const size_t index) {
+    return "s" + std::to_string(index);
+}
+
+/// Moves the value out of a slot, leaving Unit behind like a pop.
+static std::string take(const size_t index) {
+    return "std::exchange(" + slot(index) + ", Variant())";
+}
+
+static std::string literal(const Variant &constant, const size_t index) {
+    std::stringstream stream;
+    constant.visit([&]<class T>(const T &value) {
+        if constexpr (std::is_same_v<T, size_t>)
+            stream << "Variant(std::size_t{" << value << "})";
+        else if constexpr (std::is_same_v<T, long long>) {
+            if (value == std::numeric_limits<long long>::min())
+                stream << "Variant(std::numeric_limits<long long>::min())";
+            else
+                stream << "Variant(" << value << "LL)";
+        }
+        else if constexpr (std::is_same_v<T, double>) {
+            if (std::isfinite(value))
+                stream << "Variant(" << std::hexfloat << value << ")";
+            else
+                stream << "Variant(std::bit_cast<double>(" << std::bit_cast<std::uint64_t>(value) << "ULL))";
+        }
+        else if constexpr (std::is_same_v<T, Unit>)
+            stream << "Variant()";
+        else
+            stream << "constants[" << index << "]";
+    });
+    return stream.str();
+}
+
+static std::string function_name_of(const size_t entry) {
+    return "function" + std::to_string(entry);
+}
+
+/// Writes the instructions of the function starting at entry, 0 for the program itself.
+static void transpile_instructions(const Program &program, const std::vector<size_t> &depths,
+    const std::vector<size_t> &functions, const size_t entry, const std::set<size_t> &jump_targets,
+    std::ostream &stream) {
+    const auto &instructions = program.instructions;
+    size_t slots = 0;
+    for (size_t index = 0; index < depths.size(); ++index)
+        if (functions[index] == entry)
+            slots = std::max(slots, depths[index]);
+    if (slots > 0) {
+        stream << "    Variant";
+        for (size_t i = 0; i < slots; ++i)
+            stream << (i == 0 ? " " : ", ") << slot(i);
+        stream << ";\n";
+    }
+    // A function's frame starts with its arguments.
+    if (entry != 0)
+        for (size_t i = 0; i < depths[entry]; ++i)
+            stream << "    " << slot(i) << " = std::move(arguments[" << i << "]);\n";
+    for (size_t index = 0; index < instructions.size(); ++index) {
+        if (functions[index] != entry)
+            continue;
+        const auto [type, argument] = instructions[index];
+        const size_t depth = depths[index];
+        if (jump_targets.contains(index))
+            stream << "i" << index << ":\n";
+        stream << "    // " << index << ' ' << Program::instruction_name(type) << ' ' << argument << '\n';
+        const auto binary = [&](const std::string &expression) {
+            stream << "    " << slot(depth - 2) << " = " << expression << ";\n"
+                << "    " << slot(depth - 1) << " = Variant();\n";
+        };
+        const std::string first = slot(depth - 2);
+        const std::string second = slot(depth - 1);
+        switch (type) {
+            case Program::OVERFLOW_ADD: binary("Runtime::add(" + first + ", " + second + ")"); break;
+            case Program::OVERFLOW_SUB: binary("Runtime::sub(" + first + ", " + second + ")"); break;
+            case Program::OVERFLOW_MUL: binary("Runtime::mul(" + first + ", " + second + ")"); break;
+            case Program::OVERFLOW_DIV: binary(first + ".overflow_div(" + second + ").value()"); break;
+            case Program::OVERFLOW_MOD: binary(first + ".overflow_mod(" + second + ").value()"); break;
+            case Program::OR_ELSE: binary(first + ".or_else(" + second + ")"); break;
+            case Program::AND_ELSE: binary(first + ".and_else(" + second + ")"); break;
+            case Program::GET: binary("Runtime::get(" + first + ", " + second + ")"); break;
+            case Program::PUSH_CONST:
+                stream << "    " << slot(depth) << " = " << literal(program.constants[argument], argument) << ";\n";
+                break;
+            case Program::PUSH_IMMEDIATE:
+                stream << "    " << slot(depth) << " = Variant(std::size_t{" << argument << "});\n";
+                break;
+            case Program::PUSH_STACK:
+                stream << "    " << slot(depth) << " = " << slot(depth - 1 - argument) << ";\n";
+                break;
+            case Program::PUSH_GLOBAL: {
+                // The index is only known at run time, nearer values are local slots.
+                const size_t top = depth - 1;
+                stream << "    switch (const std::size_t index = " << take(top) << ".try_to_index().value()) {\n";
+                for (size_t i = 0; i < top; ++i)
+                    stream << "        case " << i << ": " << slot(top) << " = " << slot(top - 1 - i) << "; break;\n";
+                if (entry == 0)
+                    stream << "        default: " << slot(top) << " = Runtime::global(stack, index - " << top << "); break;\n";
+                else
+                    stream << "        default: throw std::out_of_range(\"Program::push_global: index out of range\");\n";
+                stream << "    }\n";
+            } break;
+            case Program::CALL: {
+                const size_t arguments = depth - 1 - argument;
+                stream << "    {\n"
+                    << "        Variant arguments[] = {";
+                for (size_t i = arguments; i < depth - 1; ++i)
+                    stream << (i == arguments ? "" : ", ") << "std::move(" << slot(i) << ")";
+                stream << "};\n"
+                    << "        " << slot(arguments) << " = Runtime::call(" << take(depth - 1) << ", arguments);\n"
+                    << "    }\n";
+                if (argument == 0)
+                    stream << "    // CALL without arguments fails at run time.\n";
+            } break;
+            case Program::CALL_LOCAL: {
+                const size_t arguments = depth - Program::call_arguments(argument);
+                const auto callee = function_name_of(Program::call_target(argument));
+                if (arguments == depth) {
+                    stream << "    " << slot(arguments) << " = " << callee << "(constants, nullptr);\n";
+                    break;
+                }
+                stream << "    {\n"
+                    << "        Variant arguments[] = {";
+                for (size_t i = arguments; i < depth; ++i)
+                    stream << (i == arguments ? "" : ", ") << "std::move(" << slot(i) << ")";
+                stream << "};\n"
+                    << "        " << slot(arguments) << " = " << callee << "(constants, arguments);\n"
+                    << "    }\n";
+            } break;
+            case Program::TAIL_CALL_LOCAL: {
+                // The frame holds just the arguments, a call of the same function restarts it.
+                const size_t callee = Program::call_target(argument);
+                if (callee == entry) {
+                    stream << "    goto i" << entry << ";\n";
+                    break;
+                }
+                stream << "    {\n"
+                    << "        Variant arguments[] = {";
+                for (size_t i = 0; i < depth; ++i)
+                    stream << (i == 0 ? "" : ", ") << "std::move(" << slot(i) << ")";
+                stream << "};\n"
+                    << "        return " << function_name_of(callee) << "(constants, arguments);\n"
+                    << "    }\n";
+            } break;
+            case Program::RETURN:
+                if (entry != 0) {
+                    stream << "    return std::move(" << slot(depth - 1) << ");\n";
+                    break;
+                }
+                if (argument > 0)
+                    stream << "    " << slot(depth - 1 - argument) << " = " << take(depth - 1) << ";\n";
+                for (size_t i = depth - argument; i < depth - 1; ++i)
+                    stream << "    " << slot(i) << " = Variant();\n";
+                stream << "    goto i" << instructions.size() << ";\n";
+                break;
+            case Program::POP:
+                for (size_t i = depth - argument; i < depth; ++i)
+                    stream << "    " << slot(i) << " = Variant();\n";
+                break;
+            case Program::SWAP:
+                if (argument > 0)
+                    stream << "    " << slot(depth - 1) << ".swap(" << slot(depth - 1 - argument) << ");\n";
+                break;
+            case Program::DELETE:
+                stream << "    " << slot(depth - 1 - argument) << " = Variant();\n";
+                break;
+            case Program::SET:
+                stream << "    Runtime::set(" << slot(depth - 3) << ", " << take(depth - 2) << ", " << take(depth - 1) << ");\n";
+                break;
+            case Program::JUMP_IF_POSITIVE:
+                stream << "    if (Runtime::jumps(" << take(depth - 1) << "))\n"
+                    << "        goto i" << argument << ";\n";
+                break;
+            default:
+                stream << "    throw std::runtime_error(\"Program::execute(): Unknown instruction\");\n";
+                break;
+        }
+    }
+}
+
+void project::transpile(const Program &program, const std::string &function_name, std::ostream &stream) {
+    const auto depths = program.verified_depths();
+    const auto functions = program.verified_functions();
+    const auto &instructions = program.instructions;
+    std::set<size_t> jump_targets;
+    std::set<size_t> entries;
+    for (size_t index = 0; index < instructions.size(); ++index) {
+        const auto [type, argument] = instructions[index];
+        if (type == Program::JUMP_IF_POSITIVE)
+            jump_targets.insert(argument);
+        if (type == Program::TAIL_CALL_LOCAL && Program::call_target(argument) == functions[index])
+            jump_targets.insert(functions[index]);
+        if (type == Program::RETURN && functions[index] == 0)
+            jump_targets.insert(instructions.size());
+        if (functions[index] != 0)
+            entries.insert(functions[index]);
+    }
+
+    stream << "// Generated by project::transpile(), do not edit.\n"
+        << "#include \"TranspiledRuntime.h\"\n\n";
+    // Functions of the program become static functions taking their arguments by pointer.
+    for (const size_t entry : entries)
+        stream << "static project::Variant " << function_name_of(entry)
+            << "(const std::vector<project::Variant>& constants, project::Variant* arguments);\n";
+    for (const size_t entry : entries) {
+        stream << "\nstatic project::Variant " << function_name_of(entry)
+            << "([[maybe_unused]] const std::vector<project::Variant>& constants,\n"
+            << "    [[maybe_unused]] project::Variant* arguments) {\n"
+            << "    using project::Variant;\n"
+            << "    using Runtime = project::TranspiledRuntime;\n";
+        transpile_instructions(program, depths, functions, entry, jump_targets, stream);
+        stream << "}\n";
+    }
+    if (entries.empty() == false)
+        stream << '\n';
+    stream << "extern \"C\" void " << function_name << "(std::vector<project::Variant>& stack,\n"
+        << "    [[maybe_unused]] const std::vector<project::Variant>& constants) {\n"
+        << "    using project::Variant;\n"
+        << "    using Runtime = project::TranspiledRuntime;\n";
+    transpile_instructions(program, depths, functions, 0, jump_targets, stream);
+    if (jump_targets.contains(instructions.size()))
+        stream << "i" << instructions.size() << ":\n";
+    for (size_t i = 0; i < depths.back(); ++i)
+        stream << "    stack.push_back(std::move(" << slot(i) << "));\n";
+    if (depths.back() == 0)
+        stream << "    return;\n";
+    stream << "}\n";
+}
+
+TranspiledLibrary::TranspiledLibrary(const std::string &path)
+    : handle(dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL))
+{
+    if (handle == nullptr)
+        throw std::runtime_error("TranspiledLibrary: " + std::string(dlerror()));
+}
+
+TranspiledLibrary::~TranspiledLibrary() {
+    dlclose(handle);
+}
+
+TranspiledLibrary::Function TranspiledLibrary::function(const std::string &function_name) const {
+    void* symbol = dlsym(handle, function_name.c_str());
+    if (symbol == nullptr)
+        throw std::runtime_error("TranspiledLibrary: no function " + function_name);
+    return reinterpret_cast<Function>(symbol);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <ostream>
+
+#include "Program.h"
+
+namespace project {
+
+    /// Writes a standalone C++ translation unit equivalent to a verified program. Stack slots
+    /// become local variables, jumps become gotos, numeric constants become literals and the
+    /// functions entered by CALL_LOCAL become static functions with slots of their own, which
+    /// restart on a tail call of themselves. It exports a function with C linkage, see
+    /// TranspiledLibrary::Function, which runs the program on top of stack like
+    /// Program::execute(). Maps and functions cannot be written as source, they are read from
+    /// constants, which must be the program's constants.
+    /// The unit includes TranspiledRuntime.h and links against the Variant runtime.
+    /// Throws VerificationError for invalid bytecode.
+    void transpile(const Program& program, const std::string& function_name, std::ostream& stream);
+
+    /// Shared object built from transpile() output by the system compiler.
+    class TranspiledLibrary {
+    public:
+        using Function = void (*)(std::vector<Variant>& stack, const std::vector<Variant>& constants);
+
+        /// Throws std::runtime_error when the library cannot be loaded.
+        explicit TranspiledLibrary(const std::string& path);
+        TranspiledLibrary(const TranspiledLibrary&) = delete;
+        TranspiledLibrary& operator=(const TranspiledLibrary&) = delete;
+        ~TranspiledLibrary();
+
+        /// Throws std::runtime_error when the library does not export function_name.
+        [[nodiscard]] Function function(const std::string& function_name) const;
+
+    private:
+        void* handle;
+    };
+
+}
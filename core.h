@@ -1,6 +1,8 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include <atomic>
+#include <bit>
 #include <memory>
 #include <vector>
 #include <functional>
@@ -15,6 +17,9 @@
 #include <cstdint>
 #include <unordered_map>
 
+#include "ExecutionArena.h"
+#include "PersistentMap.h"
+
 namespace project {
     struct Context;
     struct ASTExpression;
@@ -29,22 +34,47 @@ namespace project {
 
     struct Variant {
         using function = std::function<Variant(Variant)>;
+        /// Function taking all of its arguments at once, see native().
+        using native_function = std::function<Variant(std::span<Variant>)>;
         using map_index = long long;
-        using map = std::unordered_map<map_index, std::shared_ptr<Variant>>;
-
-        Variant();
-        explicit Variant(long long value);
-        explicit Variant(size_t value);
-        explicit Variant(double value);
+        using map = PersistentMap<map_index, Variant, ArenaAllocator<Variant>>;
+
+        /// Alternative held by a Variant. Numbers and Unit are stored inline, functions and
+        /// maps live in a reference counted heap cell shared by all copies of the value.
+        /// Cells and map storage come from the ExecutionArena of the running Program, if any.
+        enum class Type : std::uint8_t {
+            UNSIGNED,
+            SIGNED,
+            FLOATING_POINT,
+            FUNCTION,
+            UNIT,
+            MAP,
+        };
+
+        Variant() noexcept : tag(Type::UNIT), payload(0) {}
+        explicit Variant(long long value) : tag(Type::SIGNED), payload(std::bit_cast<std::uint64_t>(value)) {}
+        explicit Variant(size_t value) : tag(Type::UNSIGNED), payload(value) {}
+        explicit Variant(double value) : tag(Type::FLOATING_POINT), payload(std::bit_cast<std::uint64_t>(value)) {}
         explicit Variant(function func);
+        /// Function of arity arguments, a call passing fewer of them returns a function
+        /// waiting for the others.
+        Variant(native_function func, size_t arity);
         explicit Variant(map map);
-        Variant(const Variant&) = default;
-        Variant(Variant&&) = default;
-        Variant& operator=(const Variant&) = default;
-        Variant& operator=(Variant&&) = default;
+        Variant(const Variant& other) noexcept : tag(other.tag), payload(other.payload) { acquire(); }
+        Variant(Variant&& other) noexcept : tag(other.tag), payload(other.payload) { other.tag = Type::UNIT; }
+        Variant& operator=(const Variant& other) noexcept { Variant(other).swap(*this); return *this; }
+        Variant& operator=(Variant&& other) noexcept { Variant(std::move(other)).swap(*this); return *this; }
+        ~Variant() { if (is_inlined() == false) release(); }
 
         static Variant empty_map() { return Variant(map{}); }
 
+        /// Host function with the C++ signature SIGNATURE, for example double(long long, double),
+        /// which CALL invokes once with all of its arguments instead of once per argument.
+        /// Numbers are converted to arithmetic parameters, Variant parameters take the argument
+        /// as it is, other arguments throw ProjectError. The result is converted back.
+        template<class SIGNATURE, class FUNCTOR>
+        static Variant native(FUNCTOR functor) { return make_native(std::move(functor), static_cast<SIGNATURE*>(nullptr)); }
+
         template<std::integral T>
         static Variant integer(T value);
 
@@ -52,7 +82,8 @@ namespace project {
         static Variant floating_point(const double value) { return Variant(static_cast<double>(value));}
         static Variant floating_point(const long double value) { return Variant(static_cast<double>(value));}
 
-        [[nodiscard]] bool is_inlined() const;
+        [[nodiscard]] Type type() const { return tag; }
+        [[nodiscard]] bool is_inlined() const { return tag != Type::FUNCTION && tag != Type::MAP; }
         [[nodiscard]] bool jumps_on_jump_if_positive() const;
 
         [[nodiscard]] std::optional<Variant> overflow_add(const Variant &other) const;
@@ -71,23 +102,67 @@ namespace project {
         [[nodiscard]] std::optional<size_t> try_to_index() const;
         void unchecked_delete();
         Variant call(const std::span<Variant>& arguments);
-        void swap(Variant& other) noexcept { std::swap(data, other.data); }
+        /// Number of arguments a call of a function takes at once, fewer of them make a
+        /// partial application.
+        [[nodiscard]] size_t arity() const { return function_cell()->arity; }
+        void swap(Variant& other) noexcept { std::swap(tag, other.tag); std::swap(payload, other.payload); }
+
+        /// Calls functor with a const reference to the held value (size_t, long long,
+        /// double, native_function, Unit or map).
+        template<class FUNCTOR>
+        decltype(auto) visit(FUNCTOR&& functor) const;
 
         bool operator==(const Variant& other) const;
+        /// Same type and value, unlike operator== numbers of different types or with a different
+        /// bit pattern differ. Maps are identical with identical values under the same keys,
+        /// functions only when they share the cell.
+        [[nodiscard]] bool is_identical(const Variant& other) const;
+        /// Hash consistent with is_identical().
+        [[nodiscard]] size_t hash() const;
         friend std::ostream& operator<<(std::ostream& stream, const Variant& variant);
 
     private:
-        std::variant<size_t,
-            long long,
-            double,
-            function,
-            Unit,
-            map
-        > data;
-    public:
-        using variant = decltype(data);
+        friend struct Program;
+        friend class NativeCode;
+        friend struct TranspiledRuntime;
+        friend class ExecutionArena;
+
+        struct HeapCell {
+            std::atomic<size_t> references = 1;
+        };
+        struct FunctionCell final : HeapCell {
+            native_function value;
+            size_t arity = 1;
+        };
+        struct MapCell final : HeapCell {
+            map value;
+        };
+
+        Type tag;
+        std::uint64_t payload;
+
+        [[nodiscard]] HeapCell* cell() const { return reinterpret_cast<HeapCell*>(static_cast<std::uintptr_t>(payload)); }
+        [[nodiscard]] FunctionCell* function_cell() const { return static_cast<FunctionCell*>(cell()); }
+        [[nodiscard]] MapCell* map_cell() const { return static_cast<MapCell*>(cell()); }
+        /// Map of this value, copied first when another Variant shares the cell.
+        map& mutable_map();
+
+        void acquire() const {
+            if (is_inlined() == false)
+                cell()->references.fetch_add(1, std::memory_order_relaxed);
+        }
+        void release();
+
+        template<class FUNCTOR, class RESULT, class ... ARGUMENTS>
+        static Variant make_native(FUNCTOR functor, RESULT (*)(ARGUMENTS...));
+        template<class T>
+        static T native_argument(Variant& argument);
+        template<class T>
+        static Variant native_result(T result);
     };
 
+    static_assert(sizeof(Variant) == 2 * sizeof(std::uint64_t));
+
     struct Context {
         std::unordered_map<std::string, Symbol*> table;
 
@@ -158,7 +233,39 @@ namespace project {
         InvalidNumberOfArguments(const Symbol& function, size_t wants, size_t got);
     };
 
+    struct VerificationError final : ProjectError {
+        VerificationError(size_t instruction, const std::string& reason)
+            : ProjectError("Invalid bytecode at instruction " + std::to_string(instruction) + ": " + reason) {}
+    };
+
+
+}
 
+template<class FUNCTOR>
+decltype(auto) project::Variant::visit(FUNCTOR&& functor) const {
+    switch (tag) {
+        case Type::UNSIGNED: {
+            const auto value = static_cast<size_t>(payload);
+            return functor(value);
+        }
+        case Type::SIGNED: {
+            const auto value = std::bit_cast<long long>(payload);
+            return functor(value);
+        }
+        case Type::FLOATING_POINT: {
+            const auto value = std::bit_cast<double>(payload);
+            return functor(value);
+        }
+        case Type::FUNCTION:
+            return functor(std::as_const(function_cell()->value));
+        case Type::MAP:
+            return functor(std::as_const(map_cell()->value));
+        case Type::UNIT:
+        default: {
+            const Unit value;
+            return functor(value);
+        }
+    }
 }
 
 template<std::integral T>
@@ -172,5 +279,49 @@ project::Variant project::Variant::integer(T value) {
     return Variant(static_cast<size_t>(value));
 }
 
+template<class FUNCTOR, class RESULT, class ... ARGUMENTS>
+project::Variant project::Variant::make_native(FUNCTOR functor, RESULT (*)(ARGUMENTS...)) {
+    static_assert(sizeof...(ARGUMENTS) > 0, "Native function must take an argument");
+    return Variant(native_function([functor = std::move(functor)](const std::span<Variant> arguments) mutable {
+        return [&]<size_t ... INDEX>(std::index_sequence<INDEX...>) {
+            if constexpr (std::is_void_v<RESULT>) {
+                functor(native_argument<ARGUMENTS>(arguments[INDEX])...);
+                return Variant();
+            }
+            else
+                return native_result<RESULT>(functor(native_argument<ARGUMENTS>(arguments[INDEX])...));
+        }(std::index_sequence_for<ARGUMENTS...>{});
+    }), sizeof...(ARGUMENTS));
+}
+
+template<class T>
+T project::Variant::native_argument(Variant &argument) {
+    if constexpr (std::is_same_v<T, Variant>)
+        return std::move(argument);
+    else if constexpr (std::is_same_v<std::remove_cvref_t<T>, Variant>)
+        return argument;
+    else {
+        static_assert(std::is_arithmetic_v<T>, "Native function parameters must be numbers or Variants");
+        return argument.visit([]<class HELD>(const HELD& value) -> T {
+            if constexpr (std::is_arithmetic_v<HELD>)
+                return static_cast<T>(value);
+            else
+                throw ProjectError("Native function argument is not a number");
+        });
+    }
+}
+
+template<class T>
+project::Variant project::Variant::native_result(T result) {
+    if constexpr (std::is_same_v<T, Variant>)
+        return result;
+    else if constexpr (std::is_floating_point_v<T>)
+        return floating_point(result);
+    else {
+        static_assert(std::is_integral_v<T>, "Native function must return a number or a Variant");
+        return integer(result);
+    }
+}
+
 #endif //CORE_H
 